@@ -10,7 +10,13 @@
 
 #include "config.h"
 
+#include <errno.h>
 #include <locale.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <gio/gunixfdlist.h>
+#include <glib-unix.h>
 #include <polkit/polkit.h>
 
 #include "power-profiles-daemon-resources.h"
@@ -18,11 +24,37 @@
 #include "ppd-driver.h"
 #include "ppd-action.h"
 #include "ppd-enums.h"
+#include "ppd-utils.h"
+#include "ppd-system-monitor.h"
+#include "ppd-state-page.h"
 
 #define POWER_PROFILES_DBUS_NAME          "net.hadess.PowerProfiles"
 #define POWER_PROFILES_DBUS_PATH          "/net/hadess/PowerProfiles"
 #define POWER_PROFILES_IFACE_NAME         POWER_PROFILES_DBUS_NAME
 
+/* Hold leases expire with a precision of a second, their cookies hashed
+ * into the slot of the wheel for their expiry tick */
+#define LEASE_WHEEL_SLOTS                 64
+
+typedef enum {
+  PROP_ACTIVE_PROFILE             = 1 << 0,
+  PROP_INHIBITED                  = 1 << 1,
+  PROP_PROFILES                   = 1 << 2,
+  PROP_ACTIONS                    = 1 << 3,
+  PROP_DEGRADED                   = 1 << 4,
+  PROP_ACTIVE_PROFILE_HOLDS       = 1 << 5
+} PropertiesMask;
+
+#define PROP_ALL (PROP_ACTIVE_PROFILE | PROP_INHIBITED | PROP_PROFILES | PROP_ACTIONS | PROP_DEGRADED | PROP_ACTIVE_PROFILE_HOLDS)
+#define N_PROPERTIES 6
+
+/* Properties built from the driver, the actions or the holds, which are
+ * only rebuilt after those change */
+#define CACHED_PROPS (PROP_PROFILES | PROP_ACTIONS | PROP_ACTIVE_PROFILE_HOLDS)
+
+typedef struct _ProfileTransition ProfileTransition;
+typedef struct _ProbeRun ProbeRun;
+
 typedef struct {
   GMainLoop *main_loop;
   GDBusNodeInfo *introspection_data;
@@ -34,40 +66,314 @@ typedef struct {
   GKeyFile *config;
   char *config_path;
 
+  PpdSystemMonitor *system_monitor;
+
+  PpdStatePage *state_page;
+  guint64 transition_count;
+  PpdLatencyStats transition_stats[PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD + 1];
+
   PolkitAuthority *auth;
+  GError *auth_error;
+  GPtrArray *auth_queue; /* checks waiting for the authority */
+  GHashTable *auth_senders;
+  guint auth_generation; /* bumped when the polkit configuration changes */
 
   PpdProfile active_profile;
   PpdProfile selected_profile;
+  ProbeRun *probe_run; /* while the drivers are being probed */
   GPtrArray *probed_drivers;
   PpdDriver *driver;
   GPtrArray *actions;
-  GHashTable *profile_holds;
+  GHashTable *profile_holds; /* cookie -> ProfileHold */
+  GHashTable *requester_holds; /* requester -> ProfileHolder */
+  GHashTable *process_holds; /* pidfd -> cookie */
+  guint hold_counts[NUM_PROFILES];
+  guint last_cookie;
+
+  GHashTable *lease_slots[LEASE_WHEEL_SLOTS]; /* sets of cookies */
+  guint n_leases;
+  gint64 lease_wheel_start;
+  guint64 lease_tick; /* last expired */
+  guint lease_timer_id;
+
+  guint settle_time;
+  guint settle_id;
+
+  PropertiesMask dirty_props;
+  guint props_flush_id;
+  GVariant *emitted_props[N_PROPERTIES];
+  GVariant *cached_props[N_PROPERTIES];
+
+  ProfileTransition *transition; /* in flight */
+  GQueue *transitions; /* queued after it */
 } PpdApp;
 
+typedef void (*ProfileActivatedFunc) (PpdApp   *data,
+                                      GError   *error,
+                                      gpointer  user_data);
+
+struct _ProfileTransition {
+  PpdProfile target_profile;
+  PpdProfileActivationReason reason;
+  ProfileActivatedFunc callback;
+  gpointer user_data;
+
+  PpdDriver *driver;
+  GPtrArray *actions;
+  gboolean driver_activated;
+  guint next_action;
+  GError *error;
+  PpdWriteContext *writes;
+  GHashTable *failed_writes; /* owner -> GError */
+  gboolean driver_replaced; /* reprobed while the transition ran */
+
+  /* Monotonic times at which each stage started */
+  gint64 queue_time;
+  gint64 driver_time;
+  gint64 actions_time;
+  gint64 commit_time;
+  gint64 action_time; /* of the action being activated */
+};
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  GVariant *reply;
+  guint mask;
+  PpdProfile profile;
+} PendingReply;
+
+/* Strings are interned, as many holds share the same requester,
+ * application or reason */
 typedef struct {
   PpdProfile profile;
   char *reason;
   char *application_id;
   char *requester;
+  guint lease; /* in seconds, 0 if the hold doesn't expire */
+  guint64 expiry_tick;
+  int pidfd; /* -1 unless the hold ends with a process */
+  guint pidfd_watch_id;
 } ProfileHold;
 
+static ProfileHold *
+profile_hold_new (PpdProfile  profile,
+                  const char *reason,
+                  const char *application_id,
+                  const char *requester)
+{
+  ProfileHold *hold;
+
+  hold = g_new0 (ProfileHold, 1);
+  hold->profile = profile;
+  hold->reason = g_ref_string_new_intern (reason);
+  hold->application_id = g_ref_string_new_intern (application_id);
+  hold->requester = g_ref_string_new_intern (requester);
+  hold->pidfd = -1;
+  return hold;
+}
+
 static void
 profile_hold_free (ProfileHold *hold)
 {
   if (hold == NULL)
     return;
-  g_free (hold->reason);
-  g_free (hold->application_id);
-  g_free (hold->requester);
+  g_clear_handle_id (&hold->pidfd_watch_id, g_source_remove);
+  if (hold->pidfd >= 0)
+    close (hold->pidfd);
+  g_ref_string_release (hold->reason);
+  g_ref_string_release (hold->application_id);
+  g_ref_string_release (hold->requester);
   g_free (hold);
 }
 
+/* A requester's holds, sharing a single watch on its bus name */
+typedef struct {
+  guint watch_id;
+  GArray *cookies;
+} ProfileHolder;
+
+static void
+profile_holder_free (ProfileHolder *holder)
+{
+  g_bus_unwatch_name (holder->watch_id);
+  g_array_unref (holder->cookies);
+  g_free (holder);
+}
+
+static void holder_disappeared (GDBusConnection *connection,
+                                const gchar     *name,
+                                gpointer         user_data);
+static gboolean process_exited (int           fd,
+                                GIOCondition  condition,
+                                gpointer      user_data);
+
+static guint
+new_hold_cookie (PpdApp *data)
+{
+  /* Skip 0, and cookies still in use once the counter wraps around */
+  do {
+    data->last_cookie++;
+  } while (data->last_cookie == 0 ||
+           g_hash_table_contains (data->profile_holds, GUINT_TO_POINTER (data->last_cookie)));
+  return data->last_cookie;
+}
+
+static gboolean lease_timer_cb (gpointer user_data);
+
+static guint64
+get_lease_tick (PpdApp *data)
+{
+  return (g_get_monotonic_time () - data->lease_wheel_start) / G_USEC_PER_SEC;
+}
+
+/* Expires @hold once its lease has run out, at least a full lease from now */
+static void
+schedule_lease (PpdApp      *data,
+                guint        cookie,
+                ProfileHold *hold)
+{
+  guint64 now;
+
+  if (hold->lease == 0)
+    return;
+
+  now = get_lease_tick (data);
+  if (data->n_leases++ == 0) {
+    data->lease_tick = now;
+    data->lease_timer_id = g_timeout_add_seconds (1, lease_timer_cb, data);
+  }
+  hold->expiry_tick = now + hold->lease + 1;
+  g_hash_table_add (data->lease_slots[hold->expiry_tick % LEASE_WHEEL_SLOTS],
+                    GUINT_TO_POINTER (cookie));
+}
+
+static void
+unschedule_lease (PpdApp      *data,
+                  guint        cookie,
+                  ProfileHold *hold)
+{
+  if (hold->lease == 0)
+    return;
+
+  g_hash_table_remove (data->lease_slots[hold->expiry_tick % LEASE_WHEEL_SLOTS],
+                       GUINT_TO_POINTER (cookie));
+  if (--data->n_leases == 0)
+    g_clear_handle_id (&data->lease_timer_id, g_source_remove);
+}
+
+static void
+clear_leases (PpdApp *data)
+{
+  guint i;
+
+  for (i = 0; i < LEASE_WHEEL_SLOTS; i++)
+    g_hash_table_remove_all (data->lease_slots[i]);
+  data->n_leases = 0;
+  g_clear_handle_id (&data->lease_timer_id, g_source_remove);
+}
+
+/* Drops the cached values of the @mask properties, to be rebuilt
+ * on their next read */
+static void
+invalidate_properties (PpdApp         *data,
+                       PropertiesMask  mask)
+{
+  guint i;
+
+  for (i = 0; i < N_PROPERTIES; i++) {
+    if (mask & (1 << i))
+      g_clear_pointer (&data->cached_props[i], g_variant_unref);
+  }
+}
+
+/* Returns the cookie identifying @hold */
+static guint
+add_profile_hold (PpdApp      *data,
+                  ProfileHold *hold)
+{
+  ProfileHolder *holder;
+  guint cookie;
+
+  cookie = new_hold_cookie (data);
+  g_hash_table_insert (data->profile_holds, GUINT_TO_POINTER (cookie), hold);
+  data->hold_counts[g_bit_nth_lsf (hold->profile, -1)]++;
+  invalidate_properties (data, PROP_ACTIVE_PROFILE_HOLDS);
+
+  /* Process holds outlive their requester's bus name */
+  if (hold->pidfd >= 0) {
+    hold->pidfd_watch_id = g_unix_fd_add (hold->pidfd, G_IO_IN, process_exited, data);
+    g_hash_table_insert (data->process_holds, GINT_TO_POINTER (hold->pidfd),
+                         GUINT_TO_POINTER (cookie));
+    return cookie;
+  }
+
+  holder = g_hash_table_lookup (data->requester_holds, hold->requester);
+  if (holder == NULL) {
+    holder = g_new0 (ProfileHolder, 1);
+    holder->cookies = g_array_new (FALSE, FALSE, sizeof (guint));
+    holder->watch_id = g_bus_watch_name_on_connection (data->connection, hold->requester,
+                                                       G_BUS_NAME_WATCHER_FLAGS_NONE, NULL,
+                                                       holder_disappeared, data, NULL);
+    g_hash_table_insert (data->requester_holds,
+                         g_ref_string_acquire (hold->requester), holder);
+  }
+  g_array_append_val (holder->cookies, cookie);
+
+  schedule_lease (data, cookie, hold);
+
+  return cookie;
+}
+
+static void
+remove_profile_hold (PpdApp *data,
+                     guint   cookie)
+{
+  ProfileHold *hold;
+  ProfileHolder *holder;
+  guint i;
+
+  hold = g_hash_table_lookup (data->profile_holds, GUINT_TO_POINTER (cookie));
+  g_return_if_fail (hold != NULL);
+
+  data->hold_counts[g_bit_nth_lsf (hold->profile, -1)]--;
+  invalidate_properties (data, PROP_ACTIVE_PROFILE_HOLDS);
+
+  /* Process holds have no lease, nor a requester to stop watching */
+  if (hold->pidfd >= 0) {
+    g_hash_table_remove (data->process_holds, GINT_TO_POINTER (hold->pidfd));
+    g_hash_table_remove (data->profile_holds, GUINT_TO_POINTER (cookie));
+    return;
+  }
+
+  unschedule_lease (data, cookie, hold);
+
+  /* Stops watching the requester along with its last hold */
+  holder = g_hash_table_lookup (data->requester_holds, hold->requester);
+  for (i = 0; i < holder->cookies->len; i++) {
+    if (g_array_index (holder->cookies, guint, i) == cookie) {
+      g_array_remove_index_fast (holder->cookies, i);
+      break;
+    }
+  }
+  if (holder->cookies->len == 0)
+    g_hash_table_remove (data->requester_holds, hold->requester);
+
+  g_hash_table_remove (data->profile_holds, GUINT_TO_POINTER (cookie));
+}
+
+static guint
+get_hold_count (PpdApp     *data,
+                PpdProfile  profile)
+{
+  return data->hold_counts[g_bit_nth_lsf (profile, -1)];
+}
+
 static PpdApp *ppd_app = NULL;
 
 static void stop_profile_drivers (PpdApp *data);
 static void start_profile_drivers (PpdApp *data);
 
-#define GET_DRIVER(p) (ppd_driver_get_profiles (data->driver) & p ? data->driver : NULL)
+#define GET_DRIVER(p) (data->driver != NULL && ppd_driver_get_profiles (data->driver) & p ? data->driver : NULL)
 #define ACTIVE_DRIVER (data->driver)
 
 /* profile drivers and actions */
@@ -94,17 +400,6 @@ static GTypeGetFunc objects[] = {
   ppd_action_trickle_charge_get_type,
 };
 
-typedef enum {
-  PROP_ACTIVE_PROFILE             = 1 << 0,
-  PROP_INHIBITED                  = 1 << 1,
-  PROP_PROFILES                   = 1 << 2,
-  PROP_ACTIONS                    = 1 << 3,
-  PROP_DEGRADED                   = 1 << 4,
-  PROP_ACTIVE_PROFILE_HOLDS       = 1 << 5
-} PropertiesMask;
-
-#define PROP_ALL (PROP_ACTIVE_PROFILE | PROP_INHIBITED | PROP_PROFILES | PROP_ACTIONS | PROP_DEGRADED | PROP_ACTIVE_PROFILE_HOLDS)
-
 static gboolean
 get_profile_available (PpdApp     *data,
                        PpdProfile  profile)
@@ -206,45 +501,97 @@ get_profile_holds_variant (PpdApp *data)
   return g_variant_builder_end (&builder);
 }
 
+/* In the order of the PropertiesMask bits */
+static const char *property_names[N_PROPERTIES] = {
+  "ActiveProfile",
+  "PerformanceInhibited",
+  "Profiles",
+  "Actions",
+  "PerformanceDegraded",
+  "ActiveProfileHolds",
+};
+
+static GVariant *
+build_property_variant (PpdApp *data,
+                        guint   prop_index)
+{
+  switch (1 << prop_index) {
+  case PROP_ACTIVE_PROFILE:
+    return g_variant_new_string (get_active_profile (data));
+  case PROP_INHIBITED:
+    return g_variant_new_string ("");
+  case PROP_PROFILES:
+    return get_profiles_variant (data);
+  case PROP_ACTIONS:
+    return get_actions_variant (data);
+  case PROP_DEGRADED:
+    return g_variant_new_string (get_performance_degraded (data));
+  case PROP_ACTIVE_PROFILE_HOLDS:
+    return get_profile_holds_variant (data);
+  default:
+    g_assert_not_reached ();
+  }
+}
+
+/* Returns: (transfer full): the value of the property at @prop_index */
+static GVariant *
+get_property_variant (PpdApp *data,
+                      guint   prop_index)
+{
+  if (!(CACHED_PROPS & (1 << prop_index)))
+    return g_variant_ref_sink (build_property_variant (data, prop_index));
+
+  if (data->cached_props[prop_index] == NULL)
+    data->cached_props[prop_index] = g_variant_ref_sink (build_property_variant (data, prop_index));
+  return g_variant_ref (data->cached_props[prop_index]);
+}
+
+/* Emits a single PropertiesChanged for the properties marked dirty
+ * since the last one, leaving out those that are back to the value
+ * listeners were last told about. Nothing is sent unless one of the
+ * @needed properties is dirty, so that replies that don't depend on
+ * pending changes don't break up the batch. */
 static void
-send_dbus_event (PpdApp     *data,
-                 PropertiesMask  mask)
+flush_dbus_events (PpdApp         *data,
+                   PropertiesMask  needed)
 {
   GVariantBuilder props_builder;
   GVariant *props_changed = NULL;
+  PropertiesMask mask;
+  gboolean changed = FALSE;
+  guint i;
 
-  g_assert (data->connection);
+  if (!(data->dirty_props & needed))
+    return;
 
+  g_clear_handle_id (&data->props_flush_id, g_source_remove);
+  mask = data->dirty_props;
+  data->dirty_props = 0;
   if (mask == 0)
     return;
 
-  g_assert ((mask & PROP_ALL) != 0);
-
   g_variant_builder_init (&props_builder, G_VARIANT_TYPE ("a{sv}"));
 
-  if (mask & PROP_ACTIVE_PROFILE) {
-    g_variant_builder_add (&props_builder, "{sv}", "ActiveProfile",
-                           g_variant_new_string (get_active_profile (data)));
-  }
-  if (mask & PROP_INHIBITED) {
-    g_variant_builder_add (&props_builder, "{sv}", "PerformanceInhibited",
-                           g_variant_new_string (""));
-  }
-  if (mask & PROP_DEGRADED) {
-    g_variant_builder_add (&props_builder, "{sv}", "PerformanceDegraded",
-                           g_variant_new_string (get_performance_degraded (data)));
-  }
-  if (mask & PROP_PROFILES) {
-    g_variant_builder_add (&props_builder, "{sv}", "Profiles",
-                           get_profiles_variant (data));
-  }
-  if (mask & PROP_ACTIONS) {
-    g_variant_builder_add (&props_builder, "{sv}", "Actions",
-                           get_actions_variant (data));
+  for (i = 0; i < N_PROPERTIES; i++) {
+    g_autoptr(GVariant) value = NULL;
+
+    if (!(mask & (1 << i)))
+      continue;
+
+    value = get_property_variant (data, i);
+    if (data->emitted_props[i] != NULL &&
+        (data->emitted_props[i] == value || g_variant_equal (data->emitted_props[i], value)))
+      continue;
+
+    g_variant_builder_add (&props_builder, "{sv}", property_names[i], value);
+    g_clear_pointer (&data->emitted_props[i], g_variant_unref);
+    data->emitted_props[i] = g_steal_pointer (&value);
+    changed = TRUE;
   }
-  if (mask & PROP_ACTIVE_PROFILE_HOLDS) {
-    g_variant_builder_add (&props_builder, "{sv}", "ActiveProfileHolds",
-                           get_profile_holds_variant (data));
+
+  if (!changed) {
+    g_variant_builder_clear (&props_builder);
+    return;
   }
 
   props_changed = g_variant_new ("(s@a{sv}@as)", POWER_PROFILES_IFACE_NAME,
@@ -259,6 +606,58 @@ send_dbus_event (PpdApp     *data,
                                  props_changed, NULL);
 }
 
+static gboolean
+flush_dbus_events_idle_cb (gpointer user_data)
+{
+  PpdApp *data = user_data;
+
+  data->props_flush_id = 0;
+  flush_dbus_events (data, PROP_ALL);
+  return G_SOURCE_REMOVE;
+}
+
+/* Mirrors the state into the page clients can map, unlike D-Bus
+ * signals this happens straight away */
+static void
+update_state_page (PpdApp *data)
+{
+  PpdStateData *state;
+
+  if (data->state_page == NULL)
+    return;
+
+  state = ppd_state_page_begin_write (data->state_page);
+  state->hold_count = g_hash_table_size (data->profile_holds);
+  state->transition_count = data->transition_count;
+  g_strlcpy (state->active_profile, get_active_profile (data), sizeof (state->active_profile));
+  g_strlcpy (state->selected_profile, ppd_profile_to_str (data->selected_profile),
+             sizeof (state->selected_profile));
+  g_strlcpy (state->performance_degraded, get_performance_degraded (data),
+             sizeof (state->performance_degraded));
+  ppd_state_page_end_write (data->state_page);
+}
+
+/* Marks the @mask properties as changed. They are sent together once the
+ * main loop is idle, or before a reply that depends on them, whichever is
+ * first. */
+static void
+send_dbus_event (PpdApp     *data,
+                 PropertiesMask  mask)
+{
+  g_assert (data->connection);
+
+  if (mask == 0)
+    return;
+
+  g_assert ((mask & PROP_ALL) != 0);
+
+  update_state_page (data);
+
+  data->dirty_props |= mask;
+  if (data->props_flush_id == 0)
+    data->props_flush_id = g_idle_add (flush_dbus_events_idle_cb, data);
+}
+
 static void
 save_configuration (PpdApp *data)
 {
@@ -299,149 +698,617 @@ static void
 load_configuration (PpdApp *data)
 {
   g_autoptr(GError) error = NULL;
+  g_autofree char *probe_cache_path = NULL;
 
-  if (g_getenv ("UMOCKDEV_DIR") != NULL)
+  if (g_getenv ("UMOCKDEV_DIR") != NULL) {
     data->config_path = g_build_filename (g_getenv ("UMOCKDEV_DIR"), "ppd_test_conf.ini", NULL);
-  else
+    probe_cache_path = g_build_filename (g_getenv ("UMOCKDEV_DIR"), "ppd_test_probe_cache.ini", NULL);
+  } else {
     data->config_path = g_strdup ("/var/lib/power-profiles-daemon/state.ini");
+    probe_cache_path = g_strdup ("/var/lib/power-profiles-daemon/probe-cache.ini");
+  }
   data->config = g_key_file_new ();
   if (!g_key_file_load_from_file (data->config, data->config_path, G_KEY_FILE_KEEP_COMMENTS, &error))
     g_debug ("Could not load configuration file '%s': %s", data->config_path, error->message);
+
+  ppd_utils_probe_cache_load (probe_cache_path);
 }
 
 static void
-actions_activate_profile (GPtrArray *actions,
-                          PpdProfile profile)
+profile_transition_free (ProfileTransition *transition)
 {
-  guint i;
+  g_clear_object (&transition->driver);
+  g_clear_pointer (&transition->actions, g_ptr_array_unref);
+  g_clear_error (&transition->error);
+  g_clear_pointer (&transition->writes, ppd_utils_write_context_unref);
+  g_clear_pointer (&transition->failed_writes, g_hash_table_unref);
+  g_free (transition);
+}
 
-  g_return_if_fail (actions != NULL);
+static gboolean
+commit_profile_writes (PpdWriteContext  *writes,
+                       const char       *driver_name,
+                       PpdProfile        target_profile,
+                       GHashTable      **failed_writes,
+                       GError          **error)
+{
+  g_autoptr(GHashTable) errors = NULL;
+  GHashTableIter iter;
+  gpointer key, value;
+  GError *first_error = NULL;
 
-  for (i = 0; i < actions->len; i++) {
-    g_autoptr(GError) error = NULL;
-    PpdAction *action;
-    gboolean ret;
+  errors = ppd_utils_write_batch_commit (writes);
+  if (errors == NULL)
+    return TRUE;
 
-    action = g_ptr_array_index (actions, i);
+  g_hash_table_iter_init (&iter, errors);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    if (g_strcmp0 (key, driver_name) == 0)
+      continue;
+    g_warning ("Failed to activate action '%s' to profile %s: %s",
+               (const char *) key,
+               ppd_profile_to_str (target_profile),
+               ((GError *) value)->message);
+    if (first_error == NULL)
+      first_error = value;
+  }
 
-    ret = ppd_action_activate_profile (action, profile, &error);
-    if (!ret)
-      g_warning ("Failed to activate action '%s' to profile %s: %s",
-                 ppd_profile_to_str (profile),
-                 ppd_action_get_action_name (action),
-                 error->message);
+  /* Report the driver's error over the actions' ones */
+  if (g_hash_table_contains (errors, driver_name)) {
+    first_error = g_hash_table_lookup (errors, driver_name);
+    g_warning ("Failed to activate driver '%s': %s",
+               driver_name, first_error->message);
   }
+
+  g_propagate_error (error, g_error_copy (first_error));
+  *failed_writes = g_steal_pointer (&errors);
+  return FALSE;
 }
 
-static gboolean
-activate_target_profile (PpdApp                      *data,
-                         PpdProfile                   target_profile,
-                         PpdProfileActivationReason   reason,
-                         GError                     **error)
+static void
+commit_transition_thread (GTask        *task,
+                          gpointer      source_object,
+                          gpointer      task_data,
+                          GCancellable *cancellable)
 {
-  GError *internal_error = NULL;
+  ProfileTransition *transition = task_data;
+  g_autoptr(GError) rollback_error = NULL;
+  const char *target_str;
 
-  g_debug ("Setting active profile '%s' for reason '%s' (current: '%s')",
-           ppd_profile_to_str (target_profile),
-           ppd_profile_activation_reason_to_str (reason),
-           ppd_profile_to_str (data->active_profile));
+  target_str = ppd_profile_to_str (transition->target_profile);
 
-  if (!ppd_driver_activate_profile (data->driver, target_profile, reason, &internal_error)) {
-    g_warning ("Failed to activate driver '%s': %s",
-               ppd_driver_get_driver_name (data->driver),
-               internal_error->message);
-    g_propagate_error (error, internal_error);
-    return FALSE;
-  }
+  if (transition->error == NULL)
+    commit_profile_writes (transition->writes,
+                           ppd_driver_get_driver_name (transition->driver),
+                           transition->target_profile, &transition->failed_writes,
+                           &transition->error);
+  else
+    ppd_utils_write_batch_abort (transition->writes);
 
-  actions_activate_profile (data->actions, target_profile);
+  if (transition->error == NULL)
+    ppd_utils_transaction_commit (transition->writes);
+  else if (!ppd_utils_transaction_rollback (transition->writes, &rollback_error))
+    g_warning ("Failed to undo the switch to profile '%s': %s",
+               target_str, rollback_error->message);
+  else
+    g_debug ("Undid the switch to profile '%s'", target_str);
 
-  data->active_profile = target_profile;
+  g_task_return_boolean (task, TRUE);
+}
 
-  if (reason == PPD_PROFILE_ACTIVATION_REASON_USER ||
-      reason == PPD_PROFILE_ACTIVATION_REASON_INTERNAL)
-    save_configuration (data);
+static void run_next_transition (PpdApp *data);
 
-  return TRUE;
+/* Whether the driver, then each of the actions, was "applied", "failed",
+ * was "rolled-back" because another one failed, or "skipped" after that.
+ * A driver that got replaced in the meantime failed to apply it, and the
+ * actions are "skipped", as the retry reports how they actually did. */
+static GVariant *
+get_transition_outcomes (ProfileTransition *transition)
+{
+  GVariantBuilder builder;
+  guint n_activated;
+  guint i;
+
+  n_activated = transition->driver_activated ? transition->next_action + 1 : 0;
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{ss}"));
+
+  for (i = 0; i <= transition->actions->len; i++) {
+    const char *name;
+    const char *outcome;
+
+    if (i == 0)
+      name = ppd_driver_get_driver_name (transition->driver);
+    else
+      name = ppd_action_get_action_name (g_ptr_array_index (transition->actions, i - 1));
+
+    if (transition->driver_replaced)
+      outcome = i == 0 ? "failed" : "skipped";
+    else if (transition->error == NULL)
+      outcome = "applied";
+    else if (i < n_activated)
+      outcome = transition->failed_writes != NULL &&
+                g_hash_table_contains (transition->failed_writes, name) ? "failed" : "rolled-back";
+    else if (i == n_activated)
+      outcome = "failed";
+    else
+      outcome = "skipped";
+
+    g_variant_builder_add (&builder, "{ss}", name, outcome);
+  }
+
+  return g_variant_builder_end (&builder);
 }
 
 static void
-release_all_profile_holds (PpdApp *data)
+send_profile_applied (PpdApp            *data,
+                      ProfileTransition *transition)
 {
-  GHashTableIter iter;
-  gpointer key, value;
+  GVariantBuilder durations;
+  gint64 now;
 
-  g_hash_table_iter_init (&iter, data->profile_holds);
-  while (g_hash_table_iter_next (&iter, &key, &value)) {
-    ProfileHold *hold = value;
-    guint cookie = GPOINTER_TO_UINT (key);
+  if (data->connection == NULL)
+    return;
 
-    g_dbus_connection_emit_signal (data->connection, hold->requester, POWER_PROFILES_DBUS_PATH,
-                                   POWER_PROFILES_IFACE_NAME, "ProfileReleased",
-                                   g_variant_new ("(u)", cookie), NULL);
-    g_bus_unwatch_name (cookie);
-  }
-  g_hash_table_remove_all (data->profile_holds);
+  now = g_get_monotonic_time ();
+  g_variant_builder_init (&durations, G_VARIANT_TYPE ("a{st}"));
+  g_variant_builder_add (&durations, "{st}", "queue",
+                         (guint64) (transition->driver_time - transition->queue_time));
+  g_variant_builder_add (&durations, "{st}", "driver",
+                         (guint64) (transition->actions_time - transition->driver_time));
+  g_variant_builder_add (&durations, "{st}", "actions",
+                         (guint64) (transition->commit_time - transition->actions_time));
+  g_variant_builder_add (&durations, "{st}", "commit",
+                         (guint64) (now - transition->commit_time));
+
+  g_dbus_connection_emit_signal (data->connection, NULL, POWER_PROFILES_DBUS_PATH,
+                                 POWER_PROFILES_IFACE_NAME, "ProfileApplied",
+                                 g_variant_new ("(tssx@a{ss}a{st})",
+                                                data->transition_count,
+                                                ppd_profile_to_str (transition->target_profile),
+                                                ppd_profile_activation_reason_to_str (transition->reason),
+                                                now,
+                                                get_transition_outcomes (transition),
+                                                &durations),
+                                 NULL);
 }
 
-static gboolean
-set_active_profile (PpdApp      *data,
-                    const char  *profile,
-                    GError     **error)
+/* The writes of a failed transition were undone, so the driver, and the
+ * actions that were activated, go back to the previous profile too */
+static void
+rollback_transition_state (PpdApp            *data,
+                           ProfileTransition *transition)
 {
-  PpdProfile target_profile;
-  guint mask = PROP_ACTIVE_PROFILE;
+  guint i;
 
-  target_profile = ppd_profile_from_str (profile);
-  if (target_profile == PPD_PROFILE_UNSET) {
-    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                 "Invalid profile name '%s'", profile);
-    return FALSE;
-  }
-  if (!get_profile_available (data, target_profile)) {
-    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                 "Cannot switch to unavailable profile '%s'", profile);
-    return FALSE;
+  ppd_driver_rollback_profile (transition->driver, data->active_profile);
+  if (!transition->driver_activated)
+    return;
+
+  for (i = 0; i <= transition->next_action && i < transition->actions->len; i++)
+    ppd_action_rollback_profile (g_ptr_array_index (transition->actions, i),
+                                 data->active_profile);
+}
+
+static void
+transition_committed_cb (GObject      *source_object,
+                         GAsyncResult *res,
+                         gpointer      user_data)
+{
+  PpdApp *data = user_data;
+  ProfileTransition *transition = data->transition;
+
+  data->transition = NULL;
+  data->transition_count++;
+  ppd_utils_latency_stats_add (&data->transition_stats[transition->reason],
+                               g_get_monotonic_time () - transition->queue_time);
+
+  /* The driver was reprobed in the meantime, so the profile is applied
+   * again with the new one before telling the caller how it went */
+  if (transition->error == NULL && transition->driver != data->driver) {
+    ProfileTransition *retry;
+
+    g_debug ("Driver '%s' was replaced while switching to profile %s, retrying",
+             ppd_driver_get_driver_name (transition->driver),
+             ppd_profile_to_str (transition->target_profile));
+    transition->driver_replaced = TRUE;
+    send_profile_applied (data, transition);
+
+    retry = g_new0 (ProfileTransition, 1);
+    retry->target_profile = transition->target_profile;
+    retry->reason = transition->reason;
+    retry->callback = transition->callback;
+    retry->user_data = transition->user_data;
+    retry->queue_time = g_get_monotonic_time ();
+    g_queue_push_head (data->transitions, retry);
+
+    profile_transition_free (transition);
+    run_next_transition (data);
+    return;
   }
 
-  if (target_profile == data->active_profile)
-    return TRUE;
+  if (transition->error == NULL) {
+    data->active_profile = transition->target_profile;
 
-  g_debug ("Transitioning active profile from '%s' to '%s' by user request",
-           ppd_profile_to_str (data->active_profile), profile);
+    if (transition->reason == PPD_PROFILE_ACTIVATION_REASON_USER ||
+        transition->reason == PPD_PROFILE_ACTIVATION_REASON_INTERNAL)
+      save_configuration (data);
+  } else {
+    rollback_transition_state (data, transition);
+  }
+  update_state_page (data);
+  send_profile_applied (data, transition);
 
-  if (g_hash_table_size (data->profile_holds) != 0 ) {
-    g_debug ("Releasing active profile holds");
-    release_all_profile_holds (data);
-    mask |= PROP_ACTIVE_PROFILE_HOLDS;
+  if (transition->callback)
+    transition->callback (data, transition->error, transition->user_data);
+  profile_transition_free (transition);
+
+  run_next_transition (data);
+}
+
+static void
+commit_transition (PpdApp *data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  /* Stages after a failure take no time */
+  if (data->transition->actions_time == 0)
+    data->transition->actions_time = g_get_monotonic_time ();
+  data->transition->commit_time = g_get_monotonic_time ();
+
+  /* Submitting the batched writes, or undoing them, can block */
+  task = g_task_new (NULL, NULL, transition_committed_cb, data);
+  g_task_set_task_data (task, data->transition, NULL);
+  g_task_run_in_thread (task, commit_transition_thread);
+}
+
+static void activate_next_action (PpdApp *data);
+
+static void
+action_activated_cb (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+  PpdApp *data = user_data;
+  ProfileTransition *transition = data->transition;
+  PpdAction *action = PPD_ACTION (source_object);
+  gboolean ret;
+
+  ppd_utils_latency_record (ppd_action_get_action_name (action), PPD_LATENCY_ACTIVATE_PROFILE,
+                            g_get_monotonic_time () - transition->action_time);
+  ppd_utils_write_context_push (transition->writes);
+  ret = ppd_action_activate_profile_finish (action, res, &transition->error);
+  ppd_utils_write_context_pop (transition->writes);
+  if (!ret) {
+    g_warning ("Failed to activate action '%s' to profile %s: %s",
+               ppd_action_get_action_name (action),
+               ppd_profile_to_str (transition->target_profile),
+               transition->error->message);
+    commit_transition (data);
+    return;
   }
 
-  if (!activate_target_profile (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_USER, error))
-    return FALSE;
-  data->selected_profile = target_profile;
-  send_dbus_event (data, mask);
+  transition->next_action++;
+  activate_next_action (data);
+}
 
-  return TRUE;
+static void
+activate_next_action (PpdApp *data)
+{
+  ProfileTransition *transition = data->transition;
+  PpdAction *action;
+
+  if (transition->next_action >= transition->actions->len) {
+    commit_transition (data);
+    return;
+  }
+
+  action = g_ptr_array_index (transition->actions, transition->next_action);
+  ppd_utils_write_context_set_owner (transition->writes, ppd_action_get_action_name (action));
+  transition->action_time = g_get_monotonic_time ();
+  ppd_utils_write_context_push (transition->writes);
+  ppd_action_activate_profile_async (action, transition->target_profile, NULL,
+                                     action_activated_cb, data);
+  ppd_utils_write_context_pop (transition->writes);
+}
+
+static void
+driver_activated_cb (GObject      *source_object,
+                     GAsyncResult *res,
+                     gpointer      user_data)
+{
+  PpdApp *data = user_data;
+  ProfileTransition *transition = data->transition;
+  gboolean ret;
+
+  transition->actions_time = g_get_monotonic_time ();
+  ppd_utils_latency_record (ppd_driver_get_driver_name (transition->driver), PPD_LATENCY_ACTIVATE_PROFILE,
+                            transition->actions_time - transition->driver_time);
+  /* Drivers can still write when finishing, eg. to newly plugged CPUs */
+  ppd_utils_write_context_push (transition->writes);
+  ret = ppd_driver_activate_profile_finish (transition->driver, res, &transition->error);
+  ppd_utils_write_context_pop (transition->writes);
+  if (!ret) {
+    g_warning ("Failed to activate driver '%s': %s",
+               ppd_driver_get_driver_name (transition->driver),
+               transition->error->message);
+    commit_transition (data);
+    return;
+  }
+
+  transition->driver_activated = TRUE;
+  activate_next_action (data);
+}
+
+static void
+run_next_transition (PpdApp *data)
+{
+  ProfileTransition *transition;
+  guint i;
+
+  if (data->transition != NULL)
+    return;
+
+  transition = g_queue_pop_head (data->transitions);
+  if (transition == NULL)
+    return;
+
+  if (data->driver == NULL) {
+    g_autoptr(GError) error = NULL;
+
+    g_set_error_literal (&error, G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                         "No profile driver available");
+    if (transition->callback)
+      transition->callback (data, error, transition->user_data);
+    profile_transition_free (transition);
+    run_next_transition (data);
+    return;
+  }
+
+  g_debug ("Setting active profile '%s' for reason '%s' (current: '%s')",
+           ppd_profile_to_str (transition->target_profile),
+           ppd_profile_activation_reason_to_str (transition->reason),
+           ppd_profile_to_str (data->active_profile));
+
+  /* Keep the driver and actions alive even if they get reprobed */
+  data->transition = transition;
+  transition->driver_time = g_get_monotonic_time ();
+  transition->driver = g_object_ref (data->driver);
+  transition->actions = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
+  for (i = 0; i < data->actions->len; i++)
+    g_ptr_array_add (transition->actions, g_object_ref (g_ptr_array_index (data->actions, i)));
+
+  /* Record what the driver and actions change, so that a failure
+   * in any of them doesn't leave the hardware half-way between profiles,
+   * and queue the sysfs writes so they can be submitted together. Only
+   * the writes made on behalf of the transition are part of it, others
+   * from the main loop in the meantime go straight to sysfs. */
+  transition->writes = ppd_utils_write_context_new ();
+  ppd_utils_write_context_set_owner (transition->writes,
+                                     ppd_driver_get_driver_name (transition->driver));
+
+  ppd_utils_write_context_push (transition->writes);
+  ppd_driver_activate_profile_async (transition->driver,
+                                     transition->target_profile,
+                                     transition->reason,
+                                     NULL,
+                                     driver_activated_cb,
+                                     data);
+  ppd_utils_write_context_pop (transition->writes);
 }
 
+/* Queues a transition to @target_profile. The driver and actions apply
+ * it without blocking the main loop, one transition at a time, and
+ * @callback is called once it has been applied, or rolled back. */
+static void
+activate_target_profile (PpdApp                      *data,
+                         PpdProfile                   target_profile,
+                         PpdProfileActivationReason   reason,
+                         ProfileActivatedFunc         callback,
+                         gpointer                     user_data)
+{
+  ProfileTransition *transition;
+
+  transition = g_new0 (ProfileTransition, 1);
+  transition->target_profile = target_profile;
+  transition->reason = reason;
+  transition->callback = callback;
+  transition->user_data = user_data;
+  transition->queue_time = g_get_monotonic_time ();
+
+  g_queue_push_tail (data->transitions, transition);
+  run_next_transition (data);
+}
+
+static gboolean
+transitions_idle (PpdApp *data)
+{
+  return data->transition == NULL && g_queue_is_empty (data->transitions);
+}
+
+/* The profile that will be active once the queued transitions are applied */
 static PpdProfile
-effective_hold_profile (PpdApp *data)
+get_next_active_profile (PpdApp *data)
+{
+  ProfileTransition *transition;
+
+  transition = g_queue_peek_tail (data->transitions);
+  if (transition == NULL)
+    transition = data->transition;
+  return transition ? transition->target_profile : data->active_profile;
+}
+
+static void
+profile_activated_cb (PpdApp   *data,
+                      GError   *error,
+                      gpointer  user_data)
+{
+  send_dbus_event (data, PROP_ACTIVE_PROFILE);
+}
+
+static void
+prepare_for_sleep_cb (PpdSystemMonitor *monitor,
+                      gboolean          start,
+                      gpointer          user_data)
+{
+  PpdApp *data = user_data;
+  PpdProfile profile;
+
+  if (start || data->driver == NULL)
+    return;
+
+  profile = get_next_active_profile (data);
+  g_debug ("System woke up from suspend, re-applying profile '%s'",
+           ppd_profile_to_str (profile));
+
+  /* Read back what the firmware might have reset while suspended,
+   * so that only the attributes that drifted get written again */
+  ppd_utils_sysfs_cache_verify (NULL);
+  activate_target_profile (data, profile, PPD_PROFILE_ACTIVATION_REASON_RESUME,
+                           NULL, NULL);
+}
+
+static PendingReply *
+pending_reply_new (GDBusMethodInvocation *invocation,
+                   GVariant              *reply,
+                   PropertiesMask         mask)
+{
+  PendingReply *pending;
+
+  pending = g_new0 (PendingReply, 1);
+  pending->invocation = invocation;
+  pending->reply = reply ? g_variant_ref_sink (reply) : NULL;
+  pending->mask = mask;
+  return pending;
+}
+
+static void
+pending_reply_free (PendingReply *pending)
+{
+  g_clear_pointer (&pending->reply, g_variant_unref);
+  g_free (pending);
+}
+
+/* Sends the property changes, and replies to the method call if any,
+ * ignoring activation errors like holds always did */
+static void
+pending_reply_done_cb (PpdApp   *data,
+                       GError   *error,
+                       gpointer  user_data)
+{
+  PendingReply *pending = user_data;
+
+  /* Listeners know about the changes by the time the caller gets the reply */
+  send_dbus_event (data, pending->mask);
+  flush_dbus_events (data, pending->mask);
+  if (pending->invocation)
+    g_dbus_method_invocation_return_value (pending->invocation, pending->reply);
+  pending_reply_free (pending);
+}
+
+static void
+release_all_profile_holds (PpdApp *data)
 {
   GHashTableIter iter;
-  gpointer value;
-  PpdProfile profile = PPD_PROFILE_UNSET;
+  gpointer key, value;
 
   g_hash_table_iter_init (&iter, data->profile_holds);
-  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
     ProfileHold *hold = value;
+    guint cookie = GPOINTER_TO_UINT (key);
 
-    if (hold->profile == PPD_PROFILE_POWER_SAVER) {
-      profile = PPD_PROFILE_POWER_SAVER;
-      break;
-    }
-    profile = hold->profile;
+    g_dbus_connection_emit_signal (data->connection, hold->requester, POWER_PROFILES_DBUS_PATH,
+                                   POWER_PROFILES_IFACE_NAME, "ProfileReleased",
+                                   g_variant_new ("(u)", cookie), NULL);
   }
-  return profile;
+  g_hash_table_remove_all (data->profile_holds);
+  g_hash_table_remove_all (data->requester_holds);
+  g_hash_table_remove_all (data->process_holds);
+  memset (data->hold_counts, 0, sizeof (data->hold_counts));
+  clear_leases (data);
+  invalidate_properties (data, PROP_ACTIVE_PROFILE_HOLDS);
+}
+
+static void
+cancel_pending_transition (PpdApp *data)
+{
+  if (data->settle_id == 0)
+    return;
+  g_debug ("Cancelling pending profile transition");
+  g_clear_handle_id (&data->settle_id, g_source_remove);
+}
+
+static void
+set_active_profile_done_cb (PpdApp   *data,
+                            GError   *error,
+                            gpointer  user_data)
+{
+  PendingReply *pending = user_data;
+
+  if (error != NULL) {
+    send_dbus_event (data, pending->mask & ~PROP_ACTIVE_PROFILE);
+    flush_dbus_events (data, pending->mask & ~PROP_ACTIVE_PROFILE);
+    g_dbus_method_invocation_return_gerror (pending->invocation, error);
+    pending_reply_free (pending);
+    return;
+  }
+
+  data->selected_profile = pending->profile;
+  pending_reply_done_cb (data, NULL, pending);
+}
+
+static void
+set_active_profile (PpdApp                *data,
+                    const char            *profile,
+                    GDBusMethodInvocation *invocation)
+{
+  PendingReply *pending;
+  PpdProfile target_profile;
+  guint mask = PROP_ACTIVE_PROFILE;
+
+  target_profile = ppd_profile_from_str (profile);
+  if (target_profile == PPD_PROFILE_UNSET) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Invalid profile name '%s'", profile);
+    return;
+  }
+  if (!get_profile_available (data, target_profile)) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "Cannot switch to unavailable profile '%s'", profile);
+    return;
+  }
+
+  cancel_pending_transition (data);
+
+  if (target_profile == data->active_profile && transitions_idle (data)) {
+    g_dbus_method_invocation_return_value (invocation, NULL);
+    return;
+  }
+
+  g_debug ("Transitioning active profile from '%s' to '%s' by user request",
+           ppd_profile_to_str (data->active_profile), profile);
+
+  if (g_hash_table_size (data->profile_holds) != 0 ) {
+    g_debug ("Releasing active profile holds");
+    release_all_profile_holds (data);
+    mask |= PROP_ACTIVE_PROFILE_HOLDS;
+  }
+
+  /* Only reply once the profile was applied, with the error if it failed */
+  pending = pending_reply_new (invocation, NULL, mask);
+  pending->profile = target_profile;
+  activate_target_profile (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_USER,
+                           set_active_profile_done_cb, pending);
+}
+
+static PpdProfile
+effective_hold_profile (PpdApp *data)
+{
+  /* Power saving holds win over performance ones */
+  if (get_hold_count (data, PPD_PROFILE_POWER_SAVER) > 0)
+    return PPD_PROFILE_POWER_SAVER;
+  if (get_hold_count (data, PPD_PROFILE_PERFORMANCE) > 0)
+    return PPD_PROFILE_PERFORMANCE;
+  return PPD_PROFILE_UNSET;
 }
 
 static void
@@ -459,200 +1326,789 @@ driver_performance_degraded_changed_cb (GObject    *gobject,
     return;
   }
 
-  if (!(ppd_driver_get_profiles (driver) & PPD_PROFILE_PERFORMANCE)) {
-    g_warning ("Ignored 'performance-degraded' change on non-performance driver '%s'",
-               ppd_driver_get_driver_name (driver));
-    return;
-  }
+  if (!(ppd_driver_get_profiles (driver) & PPD_PROFILE_PERFORMANCE)) {
+    g_warning ("Ignored 'performance-degraded' change on non-performance driver '%s'",
+               ppd_driver_get_driver_name (driver));
+    return;
+  }
+
+  send_dbus_event (data, PROP_DEGRADED);
+}
+
+static void
+driver_profile_changed_cb (PpdDriver *driver,
+                           PpdProfile new_profile,
+                           gpointer   user_data)
+{
+  PpdApp *data = user_data;
+
+  g_debug ("Driver '%s' switched internally to profile '%s' (current: '%s')",
+           ppd_driver_get_driver_name (driver),
+           ppd_profile_to_str (new_profile),
+           ppd_profile_to_str (data->active_profile));
+  if (new_profile == get_next_active_profile (data))
+    return;
+
+  /* Don't override the profile switch with a pending hold transition */
+  cancel_pending_transition (data);
+  activate_target_profile (data, new_profile, PPD_PROFILE_ACTIVATION_REASON_INTERNAL,
+                           profile_activated_cb, NULL);
+}
+
+static int
+profile_performance_rank (PpdProfile profile)
+{
+  switch (profile) {
+  case PPD_PROFILE_POWER_SAVER:
+    return 0;
+  case PPD_PROFILE_BALANCED:
+    return 1;
+  case PPD_PROFILE_PERFORMANCE:
+    return 2;
+  default:
+    g_assert_not_reached ();
+  }
+  return -1;
+}
+
+static PpdProfile
+get_hold_target_profile (PpdApp *data)
+{
+  PpdProfile profile;
+
+  /* Go back to the last manually activated profile without holds */
+  profile = effective_hold_profile (data);
+  if (profile == PPD_PROFILE_UNSET)
+    profile = data->selected_profile;
+  return profile;
+}
+
+static gboolean
+settle_timeout_cb (gpointer user_data)
+{
+  PpdApp *data = user_data;
+  PpdProfile target_profile;
+
+  data->settle_id = 0;
+
+  target_profile = get_hold_target_profile (data);
+  if (target_profile != get_next_active_profile (data)) {
+    g_debug ("Profile holds settled, activating profile '%s'",
+             ppd_profile_to_str (target_profile));
+    activate_target_profile (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD,
+                             profile_activated_cb, NULL);
+  }
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Moves to the profile the current holds require. Switching to a more
+ * performant profile happens straight away, but switching to a less
+ * performant one waits for the holds to have settled for the settle time,
+ * so that short-lived holds don't cause a transition each. The @mask
+ * properties changes are sent, and @invocation replied to with @reply,
+ * once the profile is applied. */
+static void
+update_profile_from_holds (PpdApp                *data,
+                           PropertiesMask         mask,
+                           GDBusMethodInvocation *invocation,
+                           GVariant              *reply)
+{
+  PpdProfile target_profile, next_profile;
+
+  target_profile = get_hold_target_profile (data);
+  next_profile = get_next_active_profile (data);
+
+  if (target_profile == next_profile) {
+    cancel_pending_transition (data);
+  } else if (data->settle_time == 0 ||
+             profile_performance_rank (target_profile) > profile_performance_rank (next_profile)) {
+    cancel_pending_transition (data);
+    g_debug ("Next profile is %s", ppd_profile_to_str (target_profile));
+    activate_target_profile (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD,
+                             pending_reply_done_cb,
+                             pending_reply_new (invocation, reply, mask | PROP_ACTIVE_PROFILE));
+    return;
+  } else {
+    /* Every change to the holds restarts the settle window */
+    g_debug ("Switching to profile '%s' in %u ms unless holds change",
+             ppd_profile_to_str (target_profile), data->settle_time);
+    g_clear_handle_id (&data->settle_id, g_source_remove);
+    data->settle_id = g_timeout_add (data->settle_time, settle_timeout_cb, data);
+  }
+
+  pending_reply_done_cb (data, NULL, pending_reply_new (invocation, reply, mask));
+}
+
+static void
+release_profile_hold (PpdApp                *data,
+                      guint                  cookie,
+                      GDBusMethodInvocation *invocation)
+{
+  ProfileHold *hold;
+
+  hold = g_hash_table_lookup (data->profile_holds, GUINT_TO_POINTER (cookie));
+  if (!hold) {
+    g_debug("No hold with cookie %d", cookie);
+    return;
+  }
+
+  remove_profile_hold (data, cookie);
+
+  update_profile_from_holds (data, PROP_ACTIVE_PROFILE_HOLDS, invocation, NULL);
+}
+
+static gboolean
+process_exited (int           fd,
+                GIOCondition  condition,
+                gpointer      user_data)
+{
+  PpdApp *data = user_data;
+  ProfileHold *hold;
+  guint cookie;
+
+  cookie = GPOINTER_TO_UINT (g_hash_table_lookup (data->process_holds, GINT_TO_POINTER (fd)));
+  hold = g_hash_table_lookup (data->profile_holds, GUINT_TO_POINTER (cookie));
+  g_return_val_if_fail (hold != NULL, G_SOURCE_REMOVE);
+
+  /* Freeing the hold would otherwise remove the source being dispatched */
+  hold->pidfd_watch_id = 0;
+  g_debug ("Process holding cookie %u exited, removing profile hold", cookie);
+  release_profile_hold (data, cookie, NULL);
+
+  return G_SOURCE_REMOVE;
+}
+
+/* Releases the holds whose lease ran out since the last tick, all
+ * of them in the same profile transition */
+static gboolean
+lease_timer_cb (gpointer user_data)
+{
+  PpdApp *data = user_data;
+  g_autoptr(GArray) expired = NULL;
+  guint64 now, tick;
+  guint i;
+
+  now = get_lease_tick (data);
+  expired = g_array_new (FALSE, FALSE, sizeof (guint));
+
+  /* The timer might have been delayed for more than a turn of the wheel */
+  tick = MAX (data->lease_tick + 1, now >= LEASE_WHEEL_SLOTS ? now - LEASE_WHEEL_SLOTS + 1 : 0);
+  for (; tick <= now; tick++) {
+    GHashTableIter iter;
+    gpointer key;
+
+    g_hash_table_iter_init (&iter, data->lease_slots[tick % LEASE_WHEEL_SLOTS]);
+    while (g_hash_table_iter_next (&iter, &key, NULL)) {
+      guint cookie = GPOINTER_TO_UINT (key);
+      ProfileHold *hold = g_hash_table_lookup (data->profile_holds, key);
+
+      if (hold->expiry_tick <= now)
+        g_array_append_val (expired, cookie);
+    }
+  }
+  data->lease_tick = now;
+
+  if (expired->len == 0)
+    return G_SOURCE_CONTINUE;
+
+  for (i = 0; i < expired->len; i++) {
+    guint cookie = g_array_index (expired, guint, i);
+    ProfileHold *hold = g_hash_table_lookup (data->profile_holds, GUINT_TO_POINTER (cookie));
+
+    g_debug ("Lease of profile hold with cookie %u expired", cookie);
+    g_dbus_connection_emit_signal (data->connection, hold->requester, POWER_PROFILES_DBUS_PATH,
+                                   POWER_PROFILES_IFACE_NAME, "ProfileReleased",
+                                   g_variant_new ("(u)", cookie), NULL);
+    remove_profile_hold (data, cookie);
+  }
+
+  update_profile_from_holds (data, PROP_ACTIVE_PROFILE_HOLDS, NULL, NULL);
+
+  /* Releasing the last lease removed the timer */
+  return data->lease_timer_id != 0 ? G_SOURCE_CONTINUE : G_SOURCE_REMOVE;
+}
+
+static void
+holder_disappeared (GDBusConnection *connection,
+                    const gchar     *name,
+                    gpointer         user_data)
+{
+  PpdApp *data = user_data;
+  g_autoptr(GArray) cookies = NULL;
+  ProfileHolder *holder;
+  guint i;
+
+  holder = g_hash_table_lookup (data->requester_holds, name);
+  if (holder == NULL)
+    return;
+
+  /* Releasing the holds frees the holder along with the last one */
+  cookies = g_array_copy (holder->cookies);
+  for (i = 0; i < cookies->len; i++) {
+    guint cookie = g_array_index (cookies, guint, i);
+    g_debug ("Holder %s with cookie %u disappeared, removing profile hold", name, cookie);
+    release_profile_hold (data, cookie, NULL);
+  }
+}
+
+static gboolean
+check_hold_profile (PpdApp      *data,
+                    const char  *profile_name,
+                    GError     **error)
+{
+  PpdProfile profile;
+
+  profile = ppd_profile_from_str (profile_name);
+  if (profile != PPD_PROFILE_PERFORMANCE &&
+      profile != PPD_PROFILE_POWER_SAVER) {
+    g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                         "Only profiles 'performance' and 'power-saver' can be a hold profile");
+    return FALSE;
+  }
+  if (!get_profile_available (data, profile)) {
+    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                 "Cannot hold profile '%s' as it is not available",
+                 profile_name);
+    return FALSE;
+  }
+  return TRUE;
+}
+
+/* Returns the cookie of the new hold */
+static guint
+add_hold_from_request (PpdApp                *data,
+                       const char            *profile_name,
+                       const char            *reason,
+                       const char            *application_id,
+                       guint                  lease,
+                       GDBusMethodInvocation *invocation)
+{
+  ProfileHold *hold;
+
+  hold = profile_hold_new (ppd_profile_from_str (profile_name), reason, application_id,
+                           g_dbus_method_invocation_get_sender (invocation));
+  hold->lease = lease;
+
+  g_debug ("%s(%s) requesting to hold profile '%s', reason: '%s'", application_id,
+           hold->requester, profile_name, reason);
+  return add_profile_hold (data, hold);
+}
+
+static void
+hold_profile (PpdApp                *data,
+              GVariant              *parameters,
+              GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GError) error = NULL;
+  const char *profile_name;
+  const char *reason;
+  const char *application_id;
+  guint lease = 0;
+  guint cookie;
+
+  /* HoldProfileWithLease has an extra lease argument */
+  if (g_variant_is_of_type (parameters, G_VARIANT_TYPE ("(sssu)")))
+    g_variant_get (parameters, "(&s&s&su)", &profile_name, &reason, &application_id, &lease);
+  else
+    g_variant_get (parameters, "(&s&s&s)", &profile_name, &reason, &application_id);
+  if (!check_hold_profile (data, profile_name, &error)) {
+    g_dbus_method_invocation_return_gerror (invocation, error);
+    return;
+  }
+
+  cookie = add_hold_from_request (data, profile_name, reason, application_id, lease, invocation);
+
+  update_profile_from_holds (data, PROP_ACTIVE_PROFILE_HOLDS, invocation,
+                             g_variant_new ("(u)", cookie));
+}
+
+/* Checks that @fd refers to a process, even one that already exited */
+static gboolean
+check_pidfd (int      fd,
+             GError **error)
+{
+#ifdef __NR_pidfd_send_signal
+  if (syscall (__NR_pidfd_send_signal, fd, 0, NULL, 0) < 0 &&
+      errno != ESRCH && errno != EPERM) {
+    int errsv = errno;
+    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                 "Invalid pidfd: %s", g_strerror (errsv));
+    return FALSE;
+  }
+  return TRUE;
+#else
+  g_set_error_literal (error, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+                       "Process holds are not supported");
+  return FALSE;
+#endif
+}
+
+static void
+hold_profile_for_process (PpdApp                *data,
+                          GVariant              *parameters,
+                          GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GError) error = NULL;
+  GUnixFDList *fd_list;
+  const char *profile_name;
+  const char *reason;
+  const char *application_id;
+  ProfileHold *hold;
+  gint32 fd_index;
+  guint cookie;
+  int pidfd;
+
+  g_variant_get (parameters, "(&s&s&sh)", &profile_name, &reason, &application_id, &fd_index);
+  if (!check_hold_profile (data, profile_name, &error)) {
+    g_dbus_method_invocation_return_gerror (invocation, error);
+    return;
+  }
+
+  fd_list = g_dbus_message_get_unix_fd_list (g_dbus_method_invocation_get_message (invocation));
+  if (fd_list == NULL || fd_index < 0 || fd_index >= g_unix_fd_list_get_length (fd_list)) {
+    g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                                   "Missing pidfd");
+    return;
+  }
+  pidfd = g_unix_fd_list_get (fd_list, fd_index, &error);
+  if (pidfd < 0 || !check_pidfd (pidfd, &error)) {
+    if (pidfd >= 0)
+      close (pidfd);
+    g_dbus_method_invocation_return_gerror (invocation, error);
+    return;
+  }
+
+  hold = profile_hold_new (ppd_profile_from_str (profile_name), reason, application_id,
+                           g_dbus_method_invocation_get_sender (invocation));
+  hold->pidfd = pidfd;
+
+  g_debug ("%s(%s) requesting to hold profile '%s' for a process, reason: '%s'", application_id,
+           hold->requester, profile_name, reason);
+  cookie = add_profile_hold (data, hold);
+
+  update_profile_from_holds (data, PROP_ACTIVE_PROFILE_HOLDS, invocation,
+                             g_variant_new ("(u)", cookie));
+}
+
+static void
+hold_profiles (PpdApp                *data,
+               GVariant              *parameters,
+               GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GVariant) holds = NULL;
+  g_autoptr(GError) error = NULL;
+  GVariantBuilder builder;
+  GVariantIter iter;
+  const char *profile_name;
+  const char *reason;
+  const char *application_id;
+
+  g_variant_get (parameters, "(@a(sss))", &holds);
+
+  /* Either all the holds are added, or none */
+  g_variant_iter_init (&iter, holds);
+  while (g_variant_iter_next (&iter, "(&s&s&s)", &profile_name, NULL, NULL)) {
+    if (!check_hold_profile (data, profile_name, &error)) {
+      g_dbus_method_invocation_return_gerror (invocation, error);
+      return;
+    }
+  }
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("au"));
+  g_variant_iter_init (&iter, holds);
+  while (g_variant_iter_next (&iter, "(&s&s&s)", &profile_name, &reason, &application_id)) {
+    guint cookie;
+
+    cookie = add_hold_from_request (data, profile_name, reason, application_id, 0, invocation);
+    g_variant_builder_add (&builder, "u", cookie);
+  }
+
+  update_profile_from_holds (data, PROP_ACTIVE_PROFILE_HOLDS, invocation,
+                             g_variant_new ("(au)", &builder));
+}
+
+static void
+release_profile (PpdApp                *data,
+                 GVariant              *parameters,
+                 GDBusMethodInvocation *invocation)
+{
+  guint cookie;
+  g_variant_get (parameters, "(u)", &cookie);
+  if (!g_hash_table_contains (data->profile_holds, GUINT_TO_POINTER (cookie))) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                           "No hold with cookie  %d", cookie);
+    return;
+  }
+  release_profile_hold (data, cookie, invocation);
+}
+
+static void
+renew_profile (PpdApp                *data,
+               GVariant              *parameters,
+               GDBusMethodInvocation *invocation)
+{
+  ProfileHold *hold;
+  guint cookie;
+
+  g_variant_get (parameters, "(u)", &cookie);
+  hold = g_hash_table_lookup (data->profile_holds, GUINT_TO_POINTER (cookie));
+  if (hold == NULL) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                           "No hold with cookie  %d", cookie);
+    return;
+  }
+  /* Others renewing the lease would keep a stuck holder's hold around */
+  if (g_strcmp0 (g_dbus_method_invocation_get_sender (invocation), hold->requester) != 0) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_ACCESS_DENIED,
+                                           "Hold with cookie %d belongs to another client", cookie);
+    return;
+  }
+  if (hold->lease == 0) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                           "Hold with cookie %d has no lease", cookie);
+    return;
+  }
+
+  unschedule_lease (data, cookie, hold);
+  schedule_lease (data, cookie, hold);
+  g_dbus_method_invocation_return_value (invocation, NULL);
+}
+
+static void
+release_profiles (PpdApp                *data,
+                  GVariant              *parameters,
+                  GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GVariant) cookies = NULL;
+  const guint *cookie_values;
+  gsize n_cookies, i;
+
+  g_variant_get (parameters, "(@au)", &cookies);
+  cookie_values = g_variant_get_fixed_array (cookies, &n_cookies, sizeof (guint));
+
+  /* Either all the holds are released, or none */
+  for (i = 0; i < n_cookies; i++) {
+    if (!g_hash_table_contains (data->profile_holds, GUINT_TO_POINTER (cookie_values[i]))) {
+      g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                             "No hold with cookie  %d", cookie_values[i]);
+      return;
+    }
+  }
+
+  /* Cookies might be listed more than once */
+  for (i = 0; i < n_cookies; i++) {
+    if (g_hash_table_contains (data->profile_holds, GUINT_TO_POINTER (cookie_values[i])))
+      remove_profile_hold (data, cookie_values[i]);
+  }
+
+  update_profile_from_holds (data, PROP_ACTIVE_PROFILE_HOLDS, invocation, NULL);
+}
+
+static void
+get_state_page (PpdApp                *data,
+                GDBusMethodInvocation *invocation)
+{
+  g_autoptr(GUnixFDList) fd_list = NULL;
+  g_autoptr(GError) error = NULL;
+  int fd_index;
+
+  if (data->state_page == NULL) {
+    g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR, G_DBUS_ERROR_NOT_SUPPORTED,
+                                                   "No state page available");
+    return;
+  }
+
+  fd_list = g_unix_fd_list_new ();
+  fd_index = g_unix_fd_list_append (fd_list, ppd_state_page_get_fd (data->state_page), &error);
+  if (fd_index < 0) {
+    g_dbus_method_invocation_return_gerror (invocation, error);
+    return;
+  }
+
+  g_dbus_method_invocation_return_value_with_unix_fd_list (invocation,
+                                                           g_variant_new ("(h)", fd_index),
+                                                           fd_list);
+}
+
+static void
+get_statistics (PpdApp                *data,
+                GDBusMethodInvocation *invocation)
+{
+  GVariantBuilder transitions;
+  guint i;
+
+  g_variant_builder_init (&transitions, G_VARIANT_TYPE ("a{s(tttat)}"));
+  for (i = 0; i < G_N_ELEMENTS (data->transition_stats); i++) {
+    if (data->transition_stats[i].count == 0)
+      continue;
+    g_variant_builder_add (&transitions, "{s@(tttat)}",
+                           ppd_profile_activation_reason_to_str (i),
+                           ppd_utils_latency_stats_to_variant (&data->transition_stats[i]));
+  }
+
+  g_dbus_method_invocation_return_value (invocation,
+                                         g_variant_new ("(@a{sa{s(tttat)}}a{s(tttat)})",
+                                                        ppd_utils_latency_get_variant (),
+                                                        &transitions));
+}
 
-  send_dbus_event (data, PROP_DEGRADED);
+typedef void (*AuthorizedFunc) (PpdApp                *data,
+                                GVariant              *parameters,
+                                GDBusMethodInvocation *invocation);
+
+typedef struct {
+  GDBusMethodInvocation *invocation;
+  AuthorizedFunc func;
+} AuthWaiter;
+
+/* A polkit check in flight, answering every call that waits on it */
+typedef struct {
+  PpdApp *data;
+  char *sender;
+  char *action;
+  guint generation;
+  GArray *waiters;
+} AuthCheck;
+
+/* Authorization decisions for a bus name, dropped once it vanishes */
+typedef struct {
+  guint watch_id;
+  GHashTable *decisions; /* action id -> GINT_TO_POINTER (authorized) */
+  GHashTable *checks; /* action id -> AuthCheck in flight, not owned */
+} AuthSender;
+
+static void
+auth_sender_free (AuthSender *auth_sender)
+{
+  g_bus_unwatch_name (auth_sender->watch_id);
+  g_hash_table_destroy (auth_sender->decisions);
+  g_hash_table_destroy (auth_sender->checks);
+  g_free (auth_sender);
 }
 
 static void
-driver_profile_changed_cb (PpdDriver *driver,
-                           PpdProfile new_profile,
-                           gpointer   user_data)
+auth_sender_vanished (GDBusConnection *connection,
+                      const gchar     *name,
+                      gpointer         user_data)
 {
   PpdApp *data = user_data;
 
-  g_debug ("Driver '%s' switched internally to profile '%s' (current: '%s')",
-           ppd_driver_get_driver_name (driver),
-           ppd_profile_to_str (new_profile),
-           ppd_profile_to_str (data->active_profile));
-  if (new_profile == data->active_profile)
-    return;
+  g_debug ("Dropping cached authorizations for %s", name);
+  g_hash_table_remove (data->auth_senders, name);
+}
 
-  activate_target_profile (data, new_profile, PPD_PROFILE_ACTIVATION_REASON_INTERNAL, NULL);
-  send_dbus_event (data, PROP_ACTIVE_PROFILE);
+static AuthSender *
+get_auth_sender (PpdApp     *data,
+                 const char *sender)
+{
+  AuthSender *auth_sender;
+
+  auth_sender = g_hash_table_lookup (data->auth_senders, sender);
+  if (auth_sender != NULL)
+    return auth_sender;
+
+  auth_sender = g_new0 (AuthSender, 1);
+  auth_sender->decisions = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, NULL);
+  auth_sender->checks = g_hash_table_new (g_str_hash, g_str_equal);
+  auth_sender->watch_id = g_bus_watch_name_on_connection (data->connection, sender,
+                                                          G_BUS_NAME_WATCHER_FLAGS_NONE, NULL,
+                                                          auth_sender_vanished, data, NULL);
+  g_hash_table_insert (data->auth_senders, g_strdup (sender), auth_sender);
+  return auth_sender;
 }
 
 static void
-release_profile_hold (PpdApp *data,
-                      guint   cookie)
+return_not_authorized (GDBusMethodInvocation *invocation,
+                       const char            *action,
+                       const GError          *error)
 {
-  guint mask = PROP_ACTIVE_PROFILE_HOLDS;
-  ProfileHold *hold;
-  PpdProfile hold_profile, next_profile;
-
-  hold = g_hash_table_lookup (data->profile_holds, GUINT_TO_POINTER (cookie));
-  if (!hold) {
-    g_debug("No hold with cookie %d", cookie);
-    return;
-  }
-
-  g_bus_unwatch_name (cookie);
-  hold_profile = hold->profile;
-  g_hash_table_remove (data->profile_holds, GUINT_TO_POINTER (cookie));
+  g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR,
+                                         G_DBUS_ERROR_ACCESS_DENIED,
+                                         "Not Authorized: %s", error ? error->message : action);
+}
 
-  if (g_hash_table_size (data->profile_holds) == 0 &&
-      hold_profile != data->selected_profile) {
-    g_debug ("No profile holds anymore going back to last manually activated profile");
-    activate_target_profile (data, data->selected_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD, NULL);
-    mask |= PROP_ACTIVE_PROFILE;
-  } else if (hold_profile == data->active_profile) {
-    next_profile = effective_hold_profile (data);
-    if (next_profile != PPD_PROFILE_UNSET &&
-        next_profile != data->active_profile) {
-      g_debug ("Next profile is %s", ppd_profile_to_str (next_profile));
-      activate_target_profile (data, next_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD, NULL);
-      mask |= PROP_ACTIVE_PROFILE;
-    }
-  }
+static AuthCheck *
+auth_check_new (PpdApp     *data,
+                const char *sender,
+                const char *action)
+{
+  AuthCheck *check;
+
+  check = g_new0 (AuthCheck, 1);
+  check->data = data;
+  check->sender = g_strdup (sender);
+  check->action = g_strdup (action);
+  check->generation = data->auth_generation;
+  check->waiters = g_array_new (FALSE, FALSE, sizeof (AuthWaiter));
+  return check;
+}
 
-  send_dbus_event (data, mask);
+static void
+auth_check_free (AuthCheck *check)
+{
+  g_free (check->sender);
+  g_free (check->action);
+  g_array_free (check->waiters, TRUE);
+  g_free (check);
 }
 
 static void
-holder_disappeared (GDBusConnection *connection,
-                    const gchar     *name,
-                    gpointer         user_data)
+auth_check_finish (AuthCheck    *check,
+                   gboolean      authorized,
+                   const GError *error)
 {
-  PpdApp *data = user_data;
-  GHashTableIter iter;
-  gpointer key, value;
-  GPtrArray *cookies;
+  AuthSender *auth_sender;
   guint i;
 
-  cookies = g_ptr_array_new ();
-  g_hash_table_iter_init (&iter, data->profile_holds);
-  while (g_hash_table_iter_next (&iter, &key, (gpointer *) &value)) {
-    guint cookie = GPOINTER_TO_UINT (key);
-    ProfileHold *hold = value;
+  auth_sender = g_hash_table_lookup (check->data->auth_senders, check->sender);
+  if (auth_sender != NULL && g_hash_table_lookup (auth_sender->checks, check->action) == check)
+    g_hash_table_remove (auth_sender->checks, check->action);
 
-    if (g_strcmp0 (hold->requester, name) != 0)
-      continue;
+  for (i = 0; i < check->waiters->len; i++) {
+    AuthWaiter *waiter = &g_array_index (check->waiters, AuthWaiter, i);
 
-    g_debug ("Holder %s with cookie %u disappeared, adding to list", name, cookie);
-    g_ptr_array_add (cookies, GUINT_TO_POINTER (cookie));
+    if (authorized)
+      waiter->func (check->data,
+                    g_dbus_method_invocation_get_parameters (waiter->invocation),
+                    waiter->invocation);
+    else
+      return_not_authorized (waiter->invocation, check->action, error);
   }
+  auth_check_free (check);
+}
 
-  for (i = 0; i < cookies->len; i++) {
-    guint cookie = GPOINTER_TO_UINT (cookies->pdata[i]);
-    g_debug ("Removing profile hold for cookie %u", cookie);
-    release_profile_hold (data, cookie);
-  }
-  g_ptr_array_free (cookies, TRUE);
+static void
+authorization_checked_cb (GObject      *source_object,
+                          GAsyncResult *res,
+                          gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  g_autoptr(PolkitAuthorizationResult) result = NULL;
+  AuthCheck *check = user_data;
+  AuthSender *auth_sender;
+  gboolean authorized;
+
+  result = polkit_authority_check_authorization_finish (POLKIT_AUTHORITY (source_object),
+                                                        res, &error);
+  authorized = result != NULL && polkit_authorization_result_get_is_authorized (result);
+
+  /* Failed checks are retried on the next call, and the ones started
+   * before the polkit configuration changed on the next call after.
+   * Temporary authorizations expire or get revoked without polkit
+   * telling us, so those get checked again every time. */
+  auth_sender = g_hash_table_lookup (check->data->auth_senders, check->sender);
+  if (auth_sender != NULL && result != NULL &&
+      polkit_authorization_result_get_temporary_authorization_id (result) == NULL &&
+      check->generation == check->data->auth_generation)
+    g_hash_table_insert (auth_sender->decisions, g_strdup (check->action),
+                         GINT_TO_POINTER (authorized));
+
+  auth_check_finish (check, authorized, error);
 }
 
 static void
-hold_profile (PpdApp                *data,
-              GVariant              *parameters,
-              GDBusMethodInvocation *invocation)
+start_auth_check (AuthCheck *check)
 {
-  const char *profile_name;
-  const char *reason;
-  const char *application_id;
-  PpdProfile profile;
-  ProfileHold *hold;
-  guint watch_id;
-  guint mask;
+  g_autoptr(PolkitSubject) subject = NULL;
 
-  g_variant_get (parameters, "(&s&s&s)", &profile_name, &reason, &application_id);
-  profile = ppd_profile_from_str (profile_name);
-  if (profile != PPD_PROFILE_PERFORMANCE &&
-      profile != PPD_PROFILE_POWER_SAVER) {
-    g_dbus_method_invocation_return_error_literal (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                                   "Only profiles 'performance' and 'power-saver' can be a hold profile");
+  subject = polkit_system_bus_name_new (check->sender);
+  polkit_authority_check_authorization (check->data->auth,
+                                        subject,
+                                        check->action,
+                                        NULL,
+                                        POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE,
+                                        NULL,
+                                        authorization_checked_cb,
+                                        check);
+}
+
+/* Calls @func once the sender of @invocation is known to be allowed
+ * @action, or returns an error to it otherwise. Decisions are cached,
+ * unless they come from a temporary authorization, until the sender
+ * leaves the bus or the polkit configuration changes. */
+static void
+check_action_permission (PpdApp                *data,
+                         GDBusMethodInvocation *invocation,
+                         const char            *action,
+                         AuthorizedFunc         func)
+{
+  const char *sender = g_dbus_method_invocation_get_sender (invocation);
+  AuthWaiter waiter = { invocation, func };
+  AuthSender *auth_sender;
+  AuthCheck *check;
+  gpointer authorized;
+
+  if (data->auth_error != NULL) {
+    return_not_authorized (invocation, action, data->auth_error);
     return;
   }
-  if (!get_profile_available (data, profile)) {
-    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                           "Cannot hold profile '%s' as it is not available",
-                                           profile_name);
+
+  auth_sender = get_auth_sender (data, sender);
+  if (g_hash_table_lookup_extended (auth_sender->decisions, action, NULL, &authorized)) {
+    if (GPOINTER_TO_INT (authorized))
+      func (data, g_dbus_method_invocation_get_parameters (invocation), invocation);
+    else
+      return_not_authorized (invocation, action, NULL);
     return;
   }
 
-  hold = g_new0 (ProfileHold, 1);
-  hold->profile = profile;
-  hold->reason = g_strdup (reason);
-  hold->application_id = g_strdup (application_id);
-  hold->requester = g_strdup (g_dbus_method_invocation_get_sender (invocation));
-
-  g_debug ("%s(%s) requesting to hold profile '%s', reason: '%s'", application_id,
-           hold->requester, profile_name, reason);
-  watch_id = g_bus_watch_name_on_connection (data->connection, hold->requester,
-                                             G_BUS_NAME_WATCHER_FLAGS_NONE, NULL,
-                                             holder_disappeared, data, NULL);
-  g_hash_table_insert (data->profile_holds, GUINT_TO_POINTER (watch_id), hold);
-  g_dbus_method_invocation_return_value (invocation, g_variant_new ("(u)", watch_id));
-  mask = PROP_ACTIVE_PROFILE_HOLDS;
-
-  if (profile != data->active_profile) {
-    PpdProfile target_profile = effective_hold_profile (data);
-    if (target_profile != PPD_PROFILE_UNSET &&
-        target_profile != data->active_profile) {
-      activate_target_profile (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_PROGRAM_HOLD, NULL);
-      mask |= PROP_ACTIVE_PROFILE;
-    }
+  check = g_hash_table_lookup (auth_sender->checks, action);
+  if (check == NULL) {
+    check = auth_check_new (data, sender, action);
+    g_hash_table_insert (auth_sender->checks, check->action, check);
+    if (data->auth != NULL)
+      start_auth_check (check);
+    else
+      g_ptr_array_add (data->auth_queue, check);
   }
-
-  send_dbus_event (data, mask);
+  g_array_append_val (check->waiters, waiter);
 }
 
 static void
-release_profile (PpdApp                *data,
-                 GVariant              *parameters,
-                 GDBusMethodInvocation *invocation)
+authority_changed_cb (PolkitAuthority *authority,
+                      gpointer         user_data)
 {
-  guint cookie;
-  g_variant_get (parameters, "(u)", &cookie);
-  if (!g_hash_table_contains (data->profile_holds, GUINT_TO_POINTER (cookie))) {
-    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
-                                           "No hold with cookie  %d", cookie);
-    return;
+  PpdApp *data = user_data;
+  GHashTableIter iter;
+  gpointer value;
+
+  g_debug ("polkit configuration changed, dropping cached authorizations");
+  data->auth_generation++;
+  g_hash_table_iter_init (&iter, data->auth_senders);
+  while (g_hash_table_iter_next (&iter, NULL, &value)) {
+    AuthSender *auth_sender = value;
+    g_hash_table_remove_all (auth_sender->decisions);
+    /* Checks in flight still answer their callers, but later calls
+     * get a check of their own */
+    g_hash_table_remove_all (auth_sender->checks);
   }
-  release_profile_hold (data, cookie);
-  g_dbus_method_invocation_return_value (invocation, NULL);
 }
 
-static gboolean
-check_action_permission (PpdApp                *data,
-                         const char            *sender,
-                         const char            *action,
-                         GError               **error)
+static void
+authority_ready_cb (GObject      *source_object,
+                    GAsyncResult *res,
+                    gpointer      user_data)
 {
-  g_autoptr(GError) local_error = NULL;
-  g_autoptr(PolkitAuthorizationResult) result = NULL;
-  g_autoptr(PolkitSubject) subject = NULL;
+  PpdApp *data = user_data;
+  guint i;
 
-  subject = polkit_system_bus_name_new (sender);
-  result = polkit_authority_check_authorization_sync (data->auth,
-                                                      subject,
-                                                      action,
-                                                      NULL,
-                                                      POLKIT_CHECK_AUTHORIZATION_FLAGS_NONE,
-                                                      NULL, &local_error);
-  if (result == NULL ||
-      !polkit_authorization_result_get_is_authorized (result))
-    {
-      g_set_error (error, G_DBUS_ERROR,
-                   G_DBUS_ERROR_ACCESS_DENIED,
-                   "Not Authorized: %s", local_error ? local_error->message : action);
-      return FALSE;
-    }
+  data->auth = polkit_authority_get_finish (res, &data->auth_error);
+  if (data->auth == NULL)
+    g_warning ("Could not get polkit authority: %s", data->auth_error->message);
+  else
+    g_signal_connect (data->auth, "changed",
+                      G_CALLBACK (authority_changed_cb), data);
 
-  return TRUE;
+  for (i = 0; i < data->auth_queue->len; i++) {
+    AuthCheck *check = g_ptr_array_index (data->auth_queue, i);
 
+    if (data->auth != NULL)
+      start_auth_check (check);
+    else
+      auth_check_finish (check, FALSE, data->auth_error);
+  }
+  g_ptr_array_set_size (data->auth_queue, 0);
 }
 
 static GVariant *
@@ -665,49 +2121,57 @@ handle_get_property (GDBusConnection *connection,
                      gpointer         user_data)
 {
   PpdApp *data = user_data;
+  guint i;
 
   g_assert (data->connection);
 
-  if (g_strcmp0 (property_name, "ActiveProfile") == 0)
-    return g_variant_new_string (get_active_profile (data));
-  if (g_strcmp0 (property_name, "PerformanceInhibited") == 0)
-    return g_variant_new_string ("");
-  if (g_strcmp0 (property_name, "Profiles") == 0)
-    return get_profiles_variant (data);
-  if (g_strcmp0 (property_name, "Actions") == 0)
-    return get_actions_variant (data);
-  if (g_strcmp0 (property_name, "PerformanceDegraded") == 0)
-    return g_variant_new_string (get_performance_degraded (data));
-  if (g_strcmp0 (property_name, "ActiveProfileHolds") == 0)
-    return get_profile_holds_variant (data);
+  for (i = 0; i < N_PROPERTIES; i++) {
+    if (g_strcmp0 (property_name, property_names[i]) != 0)
+      continue;
+    /* Listeners must not miss a value that callers could see */
+    flush_dbus_events (data, 1 << i);
+    return get_property_variant (data, i);
+  }
   return NULL;
 }
 
-static gboolean
-handle_set_property (GDBusConnection  *connection,
-                     const gchar      *sender,
-                     const gchar      *object_path,
-                     const gchar      *interface_name,
-                     const gchar      *property_name,
-                     GVariant         *value,
-                     GError          **error,
-                     gpointer          user_data)
+static void
+switch_profile (PpdApp                *data,
+                GVariant              *parameters,
+                GDBusMethodInvocation *invocation)
 {
-  PpdApp *data = user_data;
+  g_autoptr(GVariant) value = NULL;
   const char *profile;
 
-  g_assert (data->connection);
+  g_variant_get (parameters, "(&s&sv)", NULL, NULL, &value);
+  if (!g_variant_is_of_type (value, G_VARIANT_TYPE_STRING)) {
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_INVALID_ARGS,
+                                           "Invalid type for property ActiveProfile");
+    return;
+  }
+
+  profile = g_variant_get_string (value, NULL);
+  set_active_profile (data, profile, invocation);
+}
+
+/* Properties.Set is routed here rather than through set_property so that
+ * the reply can wait for the profile to be applied */
+static void
+handle_set_property (PpdApp                *data,
+                     GVariant              *parameters,
+                     GDBusMethodInvocation *invocation)
+{
+  const char *property_name;
 
+  g_variant_get (parameters, "(&s&sv)", NULL, &property_name, NULL);
   if (g_strcmp0 (property_name, "ActiveProfile") != 0) {
-    g_set_error (error, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
-                 "No such property: %s", property_name);
-    return FALSE;
+    g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_FAILED,
+                                           "No such property: %s", property_name);
+    return;
   }
-  if (!check_action_permission (data, sender, "net.hadess.PowerProfiles.switch-profile", error))
-    return FALSE;
-
-  g_variant_get (value, "&s", &profile);
-  return set_active_profile (data, profile, error);
+  check_action_permission (data, invocation,
+                           "net.hadess.PowerProfiles.switch-profile",
+                           switch_profile);
 }
 
 static void
@@ -723,6 +2187,12 @@ handle_method_call (GDBusConnection       *connection,
   PpdApp *data = user_data;
   g_assert (data->connection);
 
+  if (g_strcmp0 (interface_name, "org.freedesktop.DBus.Properties") == 0 &&
+      g_strcmp0 (method_name, "Set") == 0) {
+    handle_set_property (data, parameters, invocation);
+    return;
+  }
+
   if (g_strcmp0 (interface_name, POWER_PROFILES_IFACE_NAME) != 0) {
     g_dbus_method_invocation_return_error (invocation,G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_INTERFACE,
                                            "Unknown interface %s", interface_name);
@@ -730,17 +2200,31 @@ handle_method_call (GDBusConnection       *connection,
   }
 
   if (g_strcmp0 (method_name, "HoldProfile") == 0) {
-    g_autoptr(GError) local_error = NULL;
-    if (!check_action_permission (data,
-                                  g_dbus_method_invocation_get_sender (invocation),
-                                  "net.hadess.PowerProfiles.hold-profile",
-                                  &local_error)) {
-      g_dbus_method_invocation_return_gerror (invocation, local_error);
-      return;
-    }
-    hold_profile (data, parameters, invocation);
+    check_action_permission (data, invocation,
+                             "net.hadess.PowerProfiles.hold-profile",
+                             hold_profile);
+  } else if (g_strcmp0 (method_name, "HoldProfileWithLease") == 0) {
+    check_action_permission (data, invocation,
+                             "net.hadess.PowerProfiles.hold-profile",
+                             hold_profile);
+  } else if (g_strcmp0 (method_name, "HoldProfileForProcess") == 0) {
+    check_action_permission (data, invocation,
+                             "net.hadess.PowerProfiles.hold-profile",
+                             hold_profile_for_process);
+  } else if (g_strcmp0 (method_name, "RenewProfile") == 0) {
+    renew_profile (data, parameters, invocation);
+  } else if (g_strcmp0 (method_name, "HoldProfiles") == 0) {
+    check_action_permission (data, invocation,
+                             "net.hadess.PowerProfiles.hold-profile",
+                             hold_profiles);
   } else if (g_strcmp0 (method_name, "ReleaseProfile") == 0) {
     release_profile (data, parameters, invocation);
+  } else if (g_strcmp0 (method_name, "ReleaseProfiles") == 0) {
+    release_profiles (data, parameters, invocation);
+  } else if (g_strcmp0 (method_name, "GetStatePage") == 0) {
+    get_state_page (data, invocation);
+  } else if (g_strcmp0 (method_name, "GetStatistics") == 0) {
+    get_statistics (data, invocation);
   } else {
       g_dbus_method_invocation_return_error (invocation, G_DBUS_ERROR, G_DBUS_ERROR_UNKNOWN_METHOD,
                                              "No such method %s in interface %s", interface_name,
@@ -753,7 +2237,7 @@ static const GDBusInterfaceVTable interface_vtable =
 {
   handle_method_call,
   handle_get_property,
-  handle_set_property
+  NULL
 };
 
 static void
@@ -775,15 +2259,23 @@ bus_acquired_handler (GDBusConnection *connection,
 {
   PpdApp *data = user_data;
 
-  g_dbus_connection_register_object (connection,
+  data->connection = g_object_ref (connection);
+}
+
+/* The interface appears once the initial profile is applied, so that
+ * clients don't see a profile the hardware isn't in yet */
+static void
+initial_profile_activated_cb (PpdApp   *data,
+                              GError   *error,
+                              gpointer  user_data)
+{
+  g_dbus_connection_register_object (data->connection,
                                      POWER_PROFILES_DBUS_PATH,
                                      data->introspection_data->interfaces[0],
                                      &interface_vtable,
                                      data,
                                      NULL,
                                      NULL);
-
-  data->connection = g_object_ref (connection);
 }
 
 static gboolean
@@ -801,38 +2293,162 @@ has_required_drivers (PpdApp *data)
   return TRUE;
 }
 
+static void
+connect_driver_signals (PpdApp    *data,
+                        PpdDriver *driver)
+{
+  g_signal_connect (G_OBJECT (driver), "notify::performance-degraded",
+                    G_CALLBACK (driver_performance_degraded_changed_cb), data);
+  g_signal_connect (G_OBJECT (driver), "profile-changed",
+                    G_CALLBACK (driver_profile_changed_cb), data);
+}
+
+/* Probes a fresh instance of a deferred driver, and swaps it in for the
+ * active driver if it is ready now. The actions and the profile holds
+ * are kept, and the effective profile is applied to the new driver. */
 static void
 driver_probe_request_cb (PpdDriver *driver,
                          gpointer   user_data)
 {
   PpdApp *data = user_data;
+  g_autoptr(PpdDriver) new_driver = NULL;
+  PpdProbeResult result;
+  PpdProfile target_profile;
+  gint64 start;
+
+  g_debug ("Reprobing driver '%s'", ppd_driver_get_driver_name (driver));
+
+  /* What changed since the first probe isn't in the cache */
+  ppd_utils_probe_cache_invalidate (ppd_driver_get_driver_name (driver));
+  new_driver = g_object_new (G_OBJECT_TYPE (driver), NULL);
+  start = g_get_monotonic_time ();
+  result = ppd_driver_probe (new_driver);
+  ppd_utils_latency_record (ppd_driver_get_driver_name (new_driver), PPD_LATENCY_PROBE,
+                            g_get_monotonic_time () - start);
+  ppd_utils_probe_cache_save ();
+  if (result == PPD_PROBE_RESULT_DEFER) {
+    g_debug ("Driver '%s' is still not ready", ppd_driver_get_driver_name (driver));
+    return;
+  }
 
-  stop_profile_drivers (data);
-  start_profile_drivers (data);
+  /* The deferred instance isn't needed anymore either way */
+  g_signal_handlers_disconnect_by_data (driver, data);
+  g_ptr_array_remove (data->probed_drivers, driver);
+
+  if (result == PPD_PROBE_RESULT_FAIL) {
+    g_debug ("probe() failed for driver %s, skipping",
+             ppd_driver_get_driver_name (new_driver));
+    return;
+  }
+
+  /* Drivers are probed in order of preference, and the deferred ones are
+   * only kept if nothing more preferred was found, so this one wins */
+  g_debug ("Replacing driver '%s' with '%s'",
+           data->driver ? ppd_driver_get_driver_name (data->driver) : "(none)",
+           ppd_driver_get_driver_name (new_driver));
+  /* The old driver closes its cached sysfs handles when finalized, and
+   * opening them again refreshed their shadow values for the new one */
+  if (data->driver != NULL)
+    g_signal_handlers_disconnect_by_data (data->driver, data);
+  g_set_object (&data->driver, new_driver);
+  connect_driver_signals (data, data->driver);
+  invalidate_properties (data, PROP_PROFILES);
+
+  /* Holds take precedence over the profile saved for that driver */
+  if (g_hash_table_size (data->profile_holds) == 0 && transitions_idle (data))
+    apply_configuration (data);
+  target_profile = get_next_active_profile (data);
+  if (!get_profile_available (data, target_profile))
+    target_profile = PPD_PROFILE_BALANCED;
+
+  activate_target_profile (data, target_profile, PPD_PROFILE_ACTIVATION_REASON_RESET,
+                           profile_activated_cb, NULL);
+  send_dbus_event (data, PROP_ALL);
 }
 
 static void
 stop_profile_drivers (PpdApp *data)
 {
+  /* Probes still running get dropped once they finish */
+  if (data->probe_run != NULL) {
+    data->probe_run->data = NULL;
+    data->probe_run = NULL;
+  }
+  cancel_pending_transition (data);
   release_all_profile_holds (data);
   g_ptr_array_set_size (data->probed_drivers, 0);
   g_ptr_array_set_size (data->actions, 0);
   g_clear_object (&data->driver);
+  invalidate_properties (data, PROP_PROFILES | PROP_ACTIONS);
+  ppd_utils_sysfs_cache_invalidate (NULL);
+}
+
+static PpdProbeResult
+probe_object (GObject *object)
+{
+  PpdProbeResult result;
+  gint64 start;
+
+  start = g_get_monotonic_time ();
+  if (PPD_IS_DRIVER (object)) {
+    result = ppd_driver_probe (PPD_DRIVER (object));
+    ppd_utils_latency_record (ppd_driver_get_driver_name (PPD_DRIVER (object)),
+                              PPD_LATENCY_PROBE, g_get_monotonic_time () - start);
+  } else {
+    result = ppd_action_probe (PPD_ACTION (object)) ?
+      PPD_PROBE_RESULT_SUCCESS : PPD_PROBE_RESULT_FAIL;
+    ppd_utils_latency_record (ppd_action_get_action_name (PPD_ACTION (object)),
+                              PPD_LATENCY_PROBE, g_get_monotonic_time () - start);
+  }
+
+  return result;
 }
 
+/* The candidate drivers and actions of a start, probed in threads */
+struct _ProbeRun {
+  PpdApp *data; /* unset if the drivers were stopped meanwhile */
+  GObject *objects[G_N_ELEMENTS (objects)];
+  PpdProbeResult results[G_N_ELEMENTS (objects)];
+  guint n_pending;
+};
+
 static void
-start_profile_drivers (PpdApp *data)
+probe_run_free (ProbeRun *run)
+{
+  guint i;
+
+  /* Drivers that lost close their handles when finalized */
+  for (i = 0; i < G_N_ELEMENTS (objects); i++)
+    g_clear_object (&run->objects[i]);
+  g_free (run);
+}
+
+static void
+probe_object_thread (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  g_task_return_int (task, probe_object (source_object));
+}
+
+static void
+finish_profile_drivers (PpdApp   *data,
+                        ProbeRun *run)
 {
   guint i;
 
+  /* Drivers are picked in order of preference, and the deferred ones are
+   * only kept if nothing more preferred was found */
   for (i = 0; i < G_N_ELEMENTS (objects); i++) {
-    GObject *object;
+    GObject *object = run->objects[i];
+
+    if (object == NULL)
+      continue;
 
-    object = g_object_new (objects[i](), NULL);
     if (PPD_IS_DRIVER (object)) {
       PpdDriver *driver = PPD_DRIVER (object);
-      PpdProfile profiles;
-      PpdProbeResult result;
+      PpdProbeResult result = run->results[i];
 
       g_debug ("Handling driver '%s'", ppd_driver_get_driver_name (driver));
 
@@ -843,60 +2459,52 @@ start_profile_drivers (PpdApp *data)
         continue;
       }
 
-      profiles = ppd_driver_get_profiles (driver);
-      if (!(profiles & PPD_PROFILE_ALL)) {
-        g_warning ("Profile Driver '%s' implements invalid profiles '0x%X'",
-                   ppd_driver_get_driver_name (driver),
-                   profiles);
-        g_object_unref (object);
-        continue;
-      }
-
-      result = ppd_driver_probe (driver);
       if (result == PPD_PROBE_RESULT_FAIL) {
         g_debug ("probe() failed for driver %s, skipping",
                  ppd_driver_get_driver_name (driver));
-        g_object_unref (object);
         continue;
       } else if (result == PPD_PROBE_RESULT_DEFER) {
         g_signal_connect (G_OBJECT (driver), "probe-request",
                           G_CALLBACK (driver_probe_request_cb), data);
-        g_ptr_array_add (data->probed_drivers, driver);
+        g_ptr_array_add (data->probed_drivers, g_steal_pointer (&run->objects[i]));
         continue;
       }
 
-      data->driver = driver;
-
-      g_signal_connect (G_OBJECT (driver), "notify::performance-degraded",
-                        G_CALLBACK (driver_performance_degraded_changed_cb), data);
-      g_signal_connect (G_OBJECT (driver), "profile-changed",
-                        G_CALLBACK (driver_profile_changed_cb), data);
+      data->driver = PPD_DRIVER (g_steal_pointer (&run->objects[i]));
+      connect_driver_signals (data, driver);
     } else if (PPD_IS_ACTION (object)) {
       PpdAction *action = PPD_ACTION (object);
 
       g_debug ("Handling action '%s'", ppd_action_get_action_name (action));
 
-      if (!ppd_action_probe (action)) {
+      if (run->results[i] != PPD_PROBE_RESULT_SUCCESS) {
         g_debug ("probe() failed for action '%s', skipping",
                  ppd_action_get_action_name (action));
-        g_object_unref (object);
         continue;
       }
 
-      g_ptr_array_add (data->actions, action);
+      g_ptr_array_add (data->actions, g_steal_pointer (&run->objects[i]));
     } else {
       g_assert_not_reached ();
     }
   }
+  ppd_utils_probe_cache_save ();
 
   if (!has_required_drivers (data)) {
     g_warning ("Some non-optional profile drivers are missing, programmer error");
     goto bail;
   }
 
+  invalidate_properties (data, PROP_PROFILES | PROP_ACTIONS);
+
   /* Set initial state either from configuration, or using the currently selected profile */
   apply_configuration (data);
-  activate_target_profile (data, data->active_profile, PPD_PROFILE_ACTIVATION_REASON_RESET, NULL);
+  if (!data->was_started)
+    activate_target_profile (data, data->active_profile, PPD_PROFILE_ACTIVATION_REASON_RESET,
+                             initial_profile_activated_cb, NULL);
+  else
+    activate_target_profile (data, data->active_profile, PPD_PROFILE_ACTIVATION_REASON_RESET,
+                             profile_activated_cb, NULL);
 
   send_dbus_event (data, PROP_ALL);
 
@@ -910,10 +2518,85 @@ bail:
   g_main_loop_quit (data->main_loop);
 }
 
+static void
+object_probed_cb (GObject      *source_object,
+                  GAsyncResult *res,
+                  gpointer      user_data)
+{
+  ProbeRun *run = user_data;
+  guint i;
+
+  i = GPOINTER_TO_UINT (g_task_get_task_data (G_TASK (res)));
+  run->results[i] = g_task_propagate_int (G_TASK (res), NULL);
+  if (--run->n_pending > 0)
+    return;
+
+  if (run->data != NULL) {
+    run->data->probe_run = NULL;
+    finish_profile_drivers (run->data, run);
+  }
+  probe_run_free (run);
+}
+
+/* Probing blocks on sysfs scans and D-Bus, so every candidate is probed
+ * in its own thread, and the drivers are picked once they all finished.
+ * The sources that probes set up are attached to the global default
+ * main context, so their callbacks still run in the main thread. */
+static void
+start_profile_drivers (PpdApp *data)
+{
+  ProbeRun *run;
+  guint i;
+
+  g_return_if_fail (data->probe_run == NULL);
+
+  run = g_new0 (ProbeRun, 1);
+  run->data = data;
+  for (i = 0; i < G_N_ELEMENTS (objects); i++) {
+    run->objects[i] = g_object_new (objects[i](), NULL);
+    run->results[i] = PPD_PROBE_RESULT_FAIL;
+
+    if (PPD_IS_DRIVER (run->objects[i])) {
+      PpdDriver *driver = PPD_DRIVER (run->objects[i]);
+      PpdProfile profiles;
+
+      profiles = ppd_driver_get_profiles (driver);
+      if (!(profiles & PPD_PROFILE_ALL)) {
+        g_warning ("Profile Driver '%s' implements invalid profiles '0x%X'",
+                   ppd_driver_get_driver_name (driver),
+                   profiles);
+        g_clear_object (&run->objects[i]);
+        continue;
+      }
+    }
+    run->n_pending++;
+  }
+
+  if (run->n_pending == 0) {
+    finish_profile_drivers (data, run);
+    probe_run_free (run);
+    return;
+  }
+
+  data->probe_run = run;
+  for (i = 0; i < G_N_ELEMENTS (objects); i++) {
+    g_autoptr(GTask) task = NULL;
+
+    if (run->objects[i] == NULL)
+      continue;
+
+    task = g_task_new (run->objects[i], NULL, object_probed_cb, run);
+    g_task_set_task_data (task, GUINT_TO_POINTER (i), NULL);
+    g_task_run_in_thread (task, probe_object_thread);
+  }
+}
+
 void
 restart_profile_drivers (void)
 {
   stop_profile_drivers (ppd_app);
+  /* Probe from scratch, the hardware might have changed since startup */
+  ppd_utils_probe_cache_invalidate (NULL);
   start_profile_drivers (ppd_app);
 }
 
@@ -960,6 +2643,8 @@ setup_dbus (PpdApp   *data,
 static void
 free_app_data (PpdApp *data)
 {
+  guint i;
+
   if (data == NULL)
     return;
 
@@ -968,14 +2653,38 @@ free_app_data (PpdApp *data)
     data->name_id = 0;
   }
 
+  if (data->probe_run != NULL)
+    data->probe_run->data = NULL;
+  g_clear_handle_id (&data->settle_id, g_source_remove);
+  g_clear_handle_id (&data->props_flush_id, g_source_remove);
+  for (i = 0; i < N_PROPERTIES; i++) {
+    g_clear_pointer (&data->emitted_props[i], g_variant_unref);
+    g_clear_pointer (&data->cached_props[i], g_variant_unref);
+  }
+  g_queue_free_full (data->transitions, (GDestroyNotify) profile_transition_free);
   g_clear_pointer (&data->config_path, g_free);
   g_clear_pointer (&data->config, g_key_file_unref);
   g_ptr_array_free (data->probed_drivers, TRUE);
   g_ptr_array_free (data->actions, TRUE);
   g_clear_object (&data->driver);
   g_hash_table_destroy (data->profile_holds);
-
+  g_hash_table_destroy (data->requester_holds);
+  g_hash_table_destroy (data->process_holds);
+  g_clear_handle_id (&data->lease_timer_id, g_source_remove);
+  for (i = 0; i < LEASE_WHEEL_SLOTS; i++)
+    g_hash_table_destroy (data->lease_slots[i]);
+  ppd_utils_sysfs_cache_invalidate (NULL);
+  g_signal_handlers_disconnect_by_data (data->system_monitor, data);
+  g_clear_object (&data->system_monitor);
+  g_clear_pointer (&data->state_page, ppd_state_page_free);
+
+  g_hash_table_destroy (data->auth_senders);
+  g_ptr_array_foreach (data->auth_queue, (GFunc) auth_check_free, NULL);
+  g_ptr_array_free (data->auth_queue, TRUE);
+  if (data->auth != NULL)
+    g_signal_handlers_disconnect_by_data (data->auth, data);
   g_clear_object (&data->auth);
+  g_clear_error (&data->auth_error);
 
   g_clear_pointer (&data->main_loop, g_main_loop_unref);
   g_clear_pointer (&data->introspection_data, g_dbus_node_info_unref);
@@ -998,9 +2707,12 @@ int main (int argc, char **argv)
   g_autoptr(GError) error = NULL;
   gboolean verbose = FALSE;
   gboolean replace = FALSE;
+  int settle_time = 0;
+  guint i;
   const GOptionEntry options[] = {
     { "verbose", 'v', 0, G_OPTION_ARG_NONE, &verbose, "Show extra debugging information", NULL },
     { "replace", 'r', 0, G_OPTION_ARG_NONE, &replace, "Replace the running instance of power-profiles-daemon", NULL },
+    { "hold-settle-time", 0, 0, G_OPTION_ARG_INT, &settle_time, "Delay in milliseconds before a released profile hold lowers performance", "MS" },
     { NULL}
   };
 
@@ -1017,21 +2729,46 @@ int main (int argc, char **argv)
   if (verbose)
     g_setenv ("G_MESSAGES_DEBUG", "all", TRUE);
 
+  if (settle_time < 0) {
+    g_print ("Invalid hold settle time %d\n", settle_time);
+    return EXIT_FAILURE;
+  }
+
   g_debug ("Starting power-profiles-daemon version "VERSION);
 
   data = g_new0 (PpdApp, 1);
   data->main_loop = g_main_loop_new (NULL, TRUE);
-  data->auth = polkit_authority_get_sync (NULL, NULL);
+  /* Created before the drivers, so that the proxies belong to the main context */
+  data->system_monitor = ppd_system_monitor_get_default ();
+  g_signal_connect (data->system_monitor, "prepare-for-sleep",
+                    G_CALLBACK (prepare_for_sleep_cb), data);
+  data->auth_queue = g_ptr_array_new ();
+  data->auth_senders = g_hash_table_new_full (g_str_hash, g_str_equal, g_free, (GDestroyNotify) auth_sender_free);
   data->probed_drivers = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
   data->actions = g_ptr_array_new_with_free_func ((GDestroyNotify) g_object_unref);
   data->profile_holds = g_hash_table_new_full (g_direct_hash, g_direct_equal, NULL, (GDestroyNotify) profile_hold_free);
+  data->requester_holds = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                                 (GDestroyNotify) g_ref_string_release,
+                                                 (GDestroyNotify) profile_holder_free);
+  data->process_holds = g_hash_table_new (g_direct_hash, g_direct_equal);
+  data->lease_wheel_start = g_get_monotonic_time ();
+  for (i = 0; i < LEASE_WHEEL_SLOTS; i++)
+    data->lease_slots[i] = g_hash_table_new (g_direct_hash, g_direct_equal);
+  data->transitions = g_queue_new ();
   data->active_profile = PPD_PROFILE_BALANCED;
   data->selected_profile = PPD_PROFILE_BALANCED;
+  data->settle_time = settle_time;
+  data->state_page = ppd_state_page_new (&error);
+  if (data->state_page == NULL) {
+    g_warning ("%s", error->message);
+    g_clear_error (&error);
+  }
   load_configuration (data);
   ppd_app = data;
 
   /* Set up D-Bus */
   setup_dbus (data, replace);
+  polkit_authority_get_async (NULL, authority_ready_cb, data);
 
   g_main_loop_run (data->main_loop);
   ret = data->ret;
@@ -42,15 +42,35 @@ ppd_action_trickle_charge_constructor (GType                  type,
   return object;
 }
 
+static gboolean
+is_device_charger (GUdevDevice *dev)
+{
+  return g_strcmp0 (g_udev_device_get_sysfs_attr (dev, "scope"), "Device") == 0 &&
+         g_udev_device_has_sysfs_attr (dev, CHARGE_TYPE_SYSFS_NAME);
+}
+
 static void
-set_charge_type (PpdActionTrickleCharge *action,
-                 const char             *charge_type)
+cache_charge_type (GUdevDevice *dev)
+{
+  g_autofree char *path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  path = g_build_filename (g_udev_device_get_sysfs_path (dev), CHARGE_TYPE_SYSFS_NAME, NULL);
+  if (!ppd_utils_sysfs_cache_open (path, &error))
+    g_debug ("Could not cache handle for '%s': %s", path, error->message);
+}
+
+/* Returns the path of the charge_type attribute to change, if any */
+static char *
+find_charge_type_path (PpdActionTrickleCharge *action,
+                       const char             *charge_type)
 {
   GList *devices, *l;
+  char *path = NULL;
 
   devices = g_udev_client_query_by_subsystem (action->client, "power_supply");
   if (devices == NULL)
-    return;
+    return NULL;
 
   for (l = devices; l != NULL; l = l->next) {
     GUdevDevice *dev = l->data;
@@ -66,12 +86,26 @@ set_charge_type (PpdActionTrickleCharge *action,
     if (g_strcmp0 (charge_type, value) == 0)
       continue;
 
-    ppd_utils_write_sysfs (dev, CHARGE_TYPE_SYSFS_NAME, charge_type, NULL);
+    /* Make sure the cached value doesn't cause the write to be skipped */
+    path = g_build_filename (g_udev_device_get_sysfs_path (dev), CHARGE_TYPE_SYSFS_NAME, NULL);
+    ppd_utils_sysfs_cache_verify (path);
 
     break;
   }
 
   g_list_free_full (devices, g_object_unref);
+  return path;
+}
+
+static void
+set_charge_type (PpdActionTrickleCharge *action,
+                 const char             *charge_type)
+{
+  g_autofree char *path = NULL;
+
+  path = find_charge_type_path (action, charge_type);
+  if (path != NULL)
+    ppd_utils_write (path, charge_type, NULL);
 }
 
 static gboolean
@@ -92,6 +126,84 @@ ppd_action_trickle_charge_activate_profile (PpdAction   *action,
   return TRUE;
 }
 
+static void
+charge_type_written_cb (GObject      *source_object,
+                        GAsyncResult *res,
+                        gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  g_autoptr(GError) error = NULL;
+
+  /* Like the synchronous version, failing to change the charge type
+   * isn't fatal for the profile change */
+  if (!ppd_utils_write_finish (res, &error))
+    g_debug ("Could not change charge type: %s", error->message);
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+ppd_action_trickle_charge_activate_profile_async (PpdAction           *action,
+                                                  PpdProfile           profile,
+                                                  GCancellable        *cancellable,
+                                                  GAsyncReadyCallback  callback,
+                                                  gpointer             user_data)
+{
+  PpdActionTrickleCharge *self = PPD_ACTION_TRICKLE_CHARGE (action);
+  g_autoptr(GTask) task = NULL;
+  g_autofree char *path = NULL;
+  const char *charge_type;
+
+  task = g_task_new (action, cancellable, callback, user_data);
+  g_task_set_source_tag (task, ppd_action_trickle_charge_activate_profile_async);
+
+  self->active = (profile == PPD_PROFILE_POWER_SAVER);
+  charge_type = self->active ? "Trickle" : "Fast";
+
+  path = find_charge_type_path (self, charge_type);
+  if (path == NULL) {
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  ppd_utils_write_async (path, charge_type, cancellable,
+                         charge_type_written_cb, g_steal_pointer (&task));
+}
+
+static gboolean
+ppd_action_trickle_charge_activate_profile_finish (PpdAction     *action,
+                                                   GAsyncResult  *result,
+                                                   GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, action), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+ppd_action_trickle_charge_rollback_profile (PpdAction  *action,
+                                            PpdProfile  profile)
+{
+  PpdActionTrickleCharge *self = PPD_ACTION_TRICKLE_CHARGE (action);
+
+  self->active = (profile == PPD_PROFILE_POWER_SAVER);
+}
+
+static gboolean
+ppd_action_trickle_charge_probe (PpdAction *action)
+{
+  PpdActionTrickleCharge *self = PPD_ACTION_TRICKLE_CHARGE (action);
+  GList *devices, *l;
+
+  devices = g_udev_client_query_by_subsystem (self->client, "power_supply");
+  for (l = devices; l != NULL; l = l->next) {
+    if (is_device_charger (l->data))
+      cache_charge_type (l->data);
+  }
+  g_list_free_full (devices, g_object_unref);
+
+  return TRUE;
+}
+
 static void
 uevent_cb (GUdevClient *client,
            gchar       *action,
@@ -101,12 +213,20 @@ uevent_cb (GUdevClient *client,
   PpdActionTrickleCharge *self = user_data;
   const char *charge_type;
 
+  if (g_strcmp0 (action, "remove") == 0) {
+    ppd_utils_sysfs_cache_invalidate (g_udev_device_get_sysfs_path (device));
+    return;
+  }
+
   if (g_strcmp0 (action, "add") != 0)
     return;
 
   if (!g_udev_device_has_sysfs_attr (device, CHARGE_TYPE_SYSFS_NAME))
     return;
 
+  if (is_device_charger (device))
+    cache_charge_type (device);
+
   charge_type = self->active ? "Trickle" : "Fast";
   g_debug ("Updating charge type for '%s' to '%s'",
            g_udev_device_get_sysfs_path (device),
@@ -135,7 +255,11 @@ ppd_action_trickle_charge_class_init (PpdActionTrickleChargeClass *klass)
   object_class->finalize = ppd_action_trickle_charge_finalize;
 
   driver_class = PPD_ACTION_CLASS(klass);
+  driver_class->probe = ppd_action_trickle_charge_probe;
   driver_class->activate_profile = ppd_action_trickle_charge_activate_profile;
+  driver_class->activate_profile_async = ppd_action_trickle_charge_activate_profile_async;
+  driver_class->activate_profile_finish = ppd_action_trickle_charge_activate_profile_finish;
+  driver_class->rollback_profile = ppd_action_trickle_charge_rollback_profile;
 }
 
 static void
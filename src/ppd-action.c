@@ -9,6 +9,7 @@
 
 #include "ppd-action.h"
 #include "ppd-enums.h"
+#include "ppd-utils.h"
 
 /**
  * SECTION:ppd-action
@@ -147,6 +148,70 @@ ppd_action_activate_profile (PpdAction  *action,
   return PPD_ACTION_GET_CLASS (action)->activate_profile (action, profile, error);
 }
 
+static void
+activate_profile_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  GError *error = NULL;
+
+  if (ppd_action_activate_profile (source_object, GPOINTER_TO_UINT (task_data), &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+void
+ppd_action_activate_profile_async (PpdAction           *action,
+                                   PpdProfile           profile,
+                                   GCancellable        *cancellable,
+                                   GAsyncReadyCallback  callback,
+                                   gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+
+  g_return_if_fail (PPD_IS_ACTION (action));
+
+  if (PPD_ACTION_GET_CLASS (action)->activate_profile_async) {
+    PPD_ACTION_GET_CLASS (action)->activate_profile_async (action, profile, cancellable,
+                                                           callback, user_data);
+    return;
+  }
+
+  /* Fall back to the synchronous implementation, in a thread
+   * that writes as part of the caller's write context */
+  task = g_task_new (action, cancellable, callback, user_data);
+  g_task_set_source_tag (task, ppd_action_activate_profile_async);
+  g_task_set_task_data (task, GUINT_TO_POINTER (profile), NULL);
+  ppd_utils_task_run_in_thread (task, activate_profile_thread);
+}
+
+gboolean
+ppd_action_activate_profile_finish (PpdAction     *action,
+                                    GAsyncResult  *result,
+                                    GError       **error)
+{
+  g_return_val_if_fail (PPD_IS_ACTION (action), FALSE);
+
+  if (g_async_result_is_tagged (result, ppd_action_activate_profile_async))
+    return g_task_propagate_boolean (G_TASK (result), error);
+
+  return PPD_ACTION_GET_CLASS (action)->activate_profile_finish (action, result, error);
+}
+
+void
+ppd_action_rollback_profile (PpdAction  *action,
+                             PpdProfile  profile)
+{
+  g_return_if_fail (PPD_IS_ACTION (action));
+
+  if (!PPD_ACTION_GET_CLASS (action)->rollback_profile)
+    return;
+
+  PPD_ACTION_GET_CLASS (action)->rollback_profile (action, profile);
+}
+
 const char *
 ppd_action_get_action_name (PpdAction *action)
 {
@@ -9,7 +9,7 @@
 
 #pragma once
 
-#include <glib-object.h>
+#include <gio/gio.h>
 #include "ppd-profile.h"
 
 #define PPD_TYPE_ACTION (ppd_action_get_type())
@@ -20,6 +20,14 @@ G_DECLARE_DERIVABLE_TYPE(PpdAction, ppd_action, PPD, ACTION, GObject)
  * @parent_class: The parent class.
  * @probe: Called by the daemon on startup.
  * @activate_profile: Called by the daemon when the profile changes.
+ * @activate_profile_async: Called by the daemon when the profile changes
+ *   instead of @activate_profile if implemented, so that slow writes
+ *   don't block the daemon. Otherwise, @activate_profile is called from
+ *   a worker thread.
+ * @activate_profile_finish: Finishes @activate_profile_async.
+ * @rollback_profile: Called by the daemon when the writes of a profile
+ *   change were undone, so that the action's state matches @profile,
+ *   which the hardware is back in.
  *
  * New profile actions should derive from #PpdAction and implement
  * at least @activate_profile.
@@ -28,14 +36,28 @@ struct _PpdActionClass
 {
   GObjectClass   parent_class;
 
-  gboolean       (* probe)            (PpdAction  *action);
-  gboolean       (* activate_profile) (PpdAction  *action,
-                                       PpdProfile  profile,
-                                       GError    **error);
+  gboolean       (* probe)                   (PpdAction            *action);
+  gboolean       (* activate_profile)        (PpdAction            *action,
+                                              PpdProfile            profile,
+                                              GError              **error);
+  void           (* activate_profile_async)  (PpdAction            *action,
+                                              PpdProfile            profile,
+                                              GCancellable         *cancellable,
+                                              GAsyncReadyCallback   callback,
+                                              gpointer              user_data);
+  gboolean       (* activate_profile_finish) (PpdAction            *action,
+                                              GAsyncResult         *result,
+                                              GError              **error);
+  void           (* rollback_profile)        (PpdAction            *action,
+                                              PpdProfile            profile);
 };
 
 #ifndef __GTK_DOC_IGNORE__
 gboolean ppd_action_probe (PpdAction *action);
 gboolean ppd_action_activate_profile (PpdAction *action, PpdProfile profile, GError **error);
+void ppd_action_activate_profile_async (PpdAction *action, PpdProfile profile,
+  GCancellable *cancellable, GAsyncReadyCallback callback, gpointer user_data);
+gboolean ppd_action_activate_profile_finish (PpdAction *action, GAsyncResult *result, GError **error);
+void ppd_action_rollback_profile (PpdAction *action, PpdProfile profile);
 const char *ppd_action_get_action_name (PpdAction *action);
 #endif
@@ -8,21 +8,22 @@
  *
  */
 
-#include <upower.h>
-
-#include "ppd-utils.h"
+#include "ppd-pstate.h"
 #include "ppd-driver-amd-pstate.h"
 
-#define CPUFREQ_POLICY_DIR "/sys/devices/system/cpu/cpufreq/"
-#define DEFAULT_CPU_FREQ_SCALING_GOV "powersave"
 #define PSTATE_STATUS_PATH "/sys/devices/system/cpu/amd_pstate/status"
 
+static const PpdPstateGroup epp_group = {
+  "EPP", PPD_PSTATE_POLICY_DIR, "policy", "energy_performance_preference",
+  ppd_pstate_probe_epp_policy, ppd_pstate_prepare_epp_policy,
+  ppd_pstate_profile_to_epp_pref, "EppPolicies"
+};
+
 struct _PpdDriverAmdPstate
 {
   PpdDriver  parent_instance;
 
-  PpdProfile activated_profile;
-  GList *epp_devices; /* GList of paths */
+  PpdPstateCpus *cpus;
 };
 
 G_DEFINE_TYPE (PpdDriverAmdPstate, ppd_driver_amd_pstate, PPD_TYPE_DRIVER)
@@ -50,138 +51,83 @@ ppd_driver_amd_pstate_constructor (GType                  type,
   return object;
 }
 
-static PpdProbeResult
-probe_epp (PpdDriverAmdPstate *pstate)
-{
-  g_autoptr(GDir) dir = NULL;
-  g_autofree char *policy_dir = NULL;
-  g_autofree char *pstate_status_path = NULL;
-  g_autofree char *status = NULL;
-  const char *dirname;
-  PpdProbeResult ret = PPD_PROBE_RESULT_FAIL;
-
-  /* Verify that AMD P-State is running in active mode */
-  pstate_status_path = ppd_utils_get_sysfs_path (PSTATE_STATUS_PATH);
-  if (!g_file_get_contents (pstate_status_path, &status, NULL, NULL))
-    return ret;
-  status = g_strchomp (status);
-  if (g_strcmp0 (status, "active") != 0) {
-    g_debug ("AMD P-State is not running in active mode");
-    return ret;
-  }
-
-  policy_dir = ppd_utils_get_sysfs_path (CPUFREQ_POLICY_DIR);
-  dir = g_dir_open (policy_dir, 0, NULL);
-  if (!dir) {
-    g_debug ("Could not open %s", policy_dir);
-    return ret;
-  }
-
-  while ((dirname = g_dir_read_name (dir)) != NULL) {
-    g_autofree char *path = NULL;
-    g_autofree char *gov_path = NULL;
-    g_autoptr(GError) error = NULL;
-
-    path = g_build_filename (policy_dir,
-                             dirname,
-                             "energy_performance_preference",
-                             NULL);
-    if (!g_file_test (path, G_FILE_TEST_EXISTS))
-      continue;
-
-    /* Force a scaling_governor where the preference can be written */
-    gov_path = g_build_filename (policy_dir,
-                                 dirname,
-                                 "scaling_governor",
-                                 NULL);
-    if (!ppd_utils_write (gov_path, DEFAULT_CPU_FREQ_SCALING_GOV, &error)) {
-      g_warning ("Could not change scaling governor %s to '%s'", dirname, DEFAULT_CPU_FREQ_SCALING_GOV);
-      continue;
-    }
-
-    pstate->epp_devices = g_list_prepend (pstate->epp_devices, g_steal_pointer (&path));
-    ret = PPD_PROBE_RESULT_SUCCESS;
-  }
-
-  return ret;
-}
 
 static PpdProbeResult
 ppd_driver_amd_pstate_probe (PpdDriver  *driver)
 {
   PpdDriverAmdPstate *pstate = PPD_DRIVER_AMD_PSTATE (driver);
+  g_autoptr(GPtrArray) epp_devices = NULL;
   PpdProbeResult ret = PPD_PROBE_RESULT_FAIL;
 
-  ret = probe_epp (pstate);
-
-  if (ret != PPD_PROBE_RESULT_SUCCESS)
+  epp_devices = g_ptr_array_new_with_free_func (g_free);
+  if (!ppd_pstate_probe_group (driver, &epp_group, PSTATE_STATUS_PATH, epp_devices))
     goto out;
 
+  pstate->cpus = ppd_pstate_cpus_new (driver, &epp_group, &epp_devices, 1);
+  ret = PPD_PROBE_RESULT_SUCCESS;
+
 out:
   g_debug ("%s p-state settings",
            ret == PPD_PROBE_RESULT_SUCCESS ? "Found" : "Didn't find");
   return ret;
 }
 
-static const char *
-profile_to_epp_pref (PpdProfile profile)
+static gboolean
+ppd_driver_amd_pstate_activate_profile (PpdDriver                    *driver,
+                                        PpdProfile                   profile,
+                                        PpdProfileActivationReason   reason,
+                                        GError                     **error)
 {
-  /* Note that we don't check "energy_performance_available_preferences"
-   * as all the values are always available */
-  switch (profile) {
-  case PPD_PROFILE_POWER_SAVER:
-    return "power";
-  case PPD_PROFILE_BALANCED:
-    return "balance_performance";
-  case PPD_PROFILE_PERFORMANCE:
-    return "performance";
-  }
+  PpdDriverAmdPstate *pstate = PPD_DRIVER_AMD_PSTATE (driver);
+
+  g_return_val_if_fail (pstate->cpus != NULL, FALSE);
 
-  g_assert_not_reached ();
+  return ppd_pstate_cpus_activate_profile (pstate->cpus, profile, error);
 }
 
-static gboolean
-apply_pref_to_devices (GList       *devices,
-                       const char  *pref,
-                       GError     **error)
+static void
+ppd_driver_amd_pstate_activate_profile_async (PpdDriver                   *driver,
+                                              PpdProfile                   profile,
+                                              PpdProfileActivationReason   reason,
+                                              GCancellable                *cancellable,
+                                              GAsyncReadyCallback          callback,
+                                              gpointer                     user_data)
 {
-  gboolean ret = TRUE;
-  GList *l;
-
-  for (l = devices; l != NULL; l = l->next) {
-    const char *path = l->data;
+  PpdDriverAmdPstate *pstate = PPD_DRIVER_AMD_PSTATE (driver);
 
-    ret = ppd_utils_write (path, pref, error);
-    if (!ret)
-      break;
+  if (pstate->cpus == NULL) {
+    g_task_report_new_error (driver, callback, user_data,
+                             ppd_driver_amd_pstate_activate_profile_async,
+                             G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                             "No energy preference to write");
+    return;
   }
 
-  return ret;
+  ppd_pstate_cpus_activate_profile_async (pstate->cpus, profile, cancellable,
+                                          callback, user_data);
 }
 
 static gboolean
-ppd_driver_amd_pstate_activate_profile (PpdDriver                    *driver,
-                                          PpdProfile                   profile,
-                                          PpdProfileActivationReason   reason,
-                                          GError                     **error)
+ppd_driver_amd_pstate_activate_profile_finish (PpdDriver     *driver,
+                                               GAsyncResult  *result,
+                                               GError       **error)
 {
   PpdDriverAmdPstate *pstate = PPD_DRIVER_AMD_PSTATE (driver);
-  gboolean ret = FALSE;
-  const char *pref;
 
-  g_return_val_if_fail (pstate->epp_devices != NULL, FALSE);
+  if (pstate->cpus == NULL)
+    return g_task_propagate_boolean (G_TASK (result), error);
 
-  if (pstate->epp_devices) {
-    pref = profile_to_epp_pref (profile);
-    ret = apply_pref_to_devices (pstate->epp_devices, pref, error);
-    if (!ret)
-      return ret;
-  }
+  return ppd_pstate_cpus_activate_profile_finish (pstate->cpus, result, error);
+}
 
-  if (ret)
-    pstate->activated_profile = profile;
+static void
+ppd_driver_amd_pstate_rollback_profile (PpdDriver  *driver,
+                                       PpdProfile  profile)
+{
+  PpdDriverAmdPstate *pstate = PPD_DRIVER_AMD_PSTATE (driver);
 
-  return ret;
+  if (pstate->cpus != NULL)
+    ppd_pstate_cpus_rollback_profile (pstate->cpus, profile);
 }
 
 static void
@@ -190,7 +136,7 @@ ppd_driver_amd_pstate_finalize (GObject *object)
   PpdDriverAmdPstate *driver;
 
   driver = PPD_DRIVER_AMD_PSTATE (object);
-  g_clear_list (&driver->epp_devices, g_free);
+  g_clear_pointer (&driver->cpus, ppd_pstate_cpus_free);
   G_OBJECT_CLASS (ppd_driver_amd_pstate_parent_class)->finalize (object);
 }
 
@@ -207,6 +153,9 @@ ppd_driver_amd_pstate_class_init (PpdDriverAmdPstateClass *klass)
   driver_class = PPD_DRIVER_CLASS(klass);
   driver_class->probe = ppd_driver_amd_pstate_probe;
   driver_class->activate_profile = ppd_driver_amd_pstate_activate_profile;
+  driver_class->activate_profile_async = ppd_driver_amd_pstate_activate_profile_async;
+  driver_class->activate_profile_finish = ppd_driver_amd_pstate_activate_profile_finish;
+  driver_class->rollback_profile = ppd_driver_amd_pstate_rollback_profile;
 }
 
 static void
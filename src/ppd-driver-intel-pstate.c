@@ -7,30 +7,18 @@
  *
  */
 
-#include <upower.h>
-
-#include "ppd-utils.h"
+#include "ppd-pstate.h"
 #include "ppd-driver-intel-pstate.h"
 
-#define CPU_DIR "/sys/devices/system/cpu/"
-#define CPUFREQ_POLICY_DIR "/sys/devices/system/cpu/cpufreq/"
-#define DEFAULT_CPU_FREQ_SCALING_GOV "powersave"
 #define PSTATE_STATUS_PATH "/sys/devices/system/cpu/intel_pstate/status"
 #define NO_TURBO_PATH "/sys/devices/system/cpu/intel_pstate/no_turbo"
 #define TURBO_PCT_PATH "/sys/devices/system/cpu/intel_pstate/turbo_pct"
 
-#define SYSTEMD_DBUS_NAME                       "org.freedesktop.login1"
-#define SYSTEMD_DBUS_PATH                       "/org/freedesktop/login1"
-#define SYSTEMD_DBUS_INTERFACE                  "org.freedesktop.login1.Manager"
-
 struct _PpdDriverIntelPstate
 {
   PpdDriver  parent_instance;
 
-  PpdProfile activated_profile;
-  GList *epp_devices; /* GList of paths */
-  GList *epb_devices; /* GList of paths */
-  GDBusProxy *logind_proxy;
+  PpdPstateCpus *cpus;
   GFileMonitor *no_turbo_mon;
   char *no_turbo_path;
 };
@@ -124,156 +112,80 @@ has_turbo (void)
   return has_turbo;
 }
 
-static void
-logind_proxy_signal_cb (GDBusProxy  *proxy,
-                        const char  *sender_name,
-                        const char  *signal_name,
-                        GVariant    *parameters,
-                        gpointer     user_data)
+/* Returns the path to the EPB preference of the @dirname CPU in @cpu_dir,
+ * or %NULL if it doesn't have one */
+static char *
+probe_epb_cpu (const char *cpu_dir,
+               const char *dirname)
 {
-  PpdDriverIntelPstate *pstate = user_data;
-  g_autoptr(GError) error = NULL;
-  gboolean start;
-  PpdProbeResult ret;
-
-  if (g_strcmp0 (signal_name, "PrepareForSleep") != 0)
-    return;
-  g_variant_get (parameters, "(b)", &start);
-  if (start)
-    return;
-
-  g_debug ("System woke up from suspend, re-applying energy_perf_bias");
-  ret = ppd_driver_intel_pstate_activate_profile (PPD_DRIVER (pstate),
-                                                  pstate->activated_profile,
-                                                  PPD_PROFILE_ACTIVATION_REASON_RESUME,
-                                                  &error);
-  if (ret != PPD_PROBE_RESULT_SUCCESS) {
-    g_warning ("Could not reapply energy_perf_bias preference on resume: %s",
-               error->message);
-  }
-}
-
-static PpdProbeResult
-probe_epb (PpdDriverIntelPstate *pstate)
-{
-  g_autoptr(GDir) dir = NULL;
-  g_autofree char *policy_dir = NULL;
-  const char *dirname;
+  g_autofree char *path = NULL;
   g_autoptr(GError) error = NULL;
-  PpdProbeResult ret = PPD_PROBE_RESULT_FAIL;
-
-  policy_dir = ppd_utils_get_sysfs_path (CPU_DIR);
-  dir = g_dir_open (policy_dir, 0, NULL);
-  if (!dir) {
-    g_debug ("Could not open %s", CPU_DIR);
-    return ret;
-  }
-
-  while ((dirname = g_dir_read_name (dir)) != NULL) {
-    g_autofree char *path = NULL;
 
-    path = g_build_filename (policy_dir,
-                             dirname,
-                             "power",
-                             "energy_perf_bias",
-                             NULL);
-    if (!g_file_test (path, G_FILE_TEST_EXISTS))
-      continue;
-
-    pstate->epb_devices = g_list_prepend (pstate->epb_devices, g_steal_pointer (&path));
-    ret = PPD_PROBE_RESULT_SUCCESS;
-  }
+  path = g_build_filename (cpu_dir,
+                           dirname,
+                           "power",
+                           "energy_perf_bias",
+                           NULL);
+  if (!g_file_test (path, G_FILE_TEST_EXISTS))
+    return NULL;
 
-  pstate->logind_proxy = g_dbus_proxy_new_for_bus_sync (G_BUS_TYPE_SYSTEM,
-                                                        0,
-                                                        NULL,
-                                                        SYSTEMD_DBUS_NAME,
-                                                        SYSTEMD_DBUS_PATH,
-                                                        SYSTEMD_DBUS_INTERFACE,
-                                                        NULL,
-                                                        &error);
-  if (!pstate->logind_proxy) {
-    g_debug ("Could not create proxy for logind: %s",
-             error->message);
-  } else {
-    g_signal_connect (pstate->logind_proxy, "g-signal",
-                      G_CALLBACK (logind_proxy_signal_cb),
-                      pstate);
-  }
+  if (!ppd_utils_sysfs_cache_open (path, &error))
+    g_debug ("Could not cache handle for '%s': %s", path, error->message);
 
-  return ret;
+  return g_steal_pointer (&path);
 }
 
-static PpdProbeResult
-probe_epp (PpdDriverIntelPstate *pstate)
+static const char *
+profile_to_epb_pref (PpdProfile profile)
 {
-  g_autoptr(GDir) dir = NULL;
-  g_autofree char *policy_dir = NULL;
-  g_autofree char *pstate_status_path = NULL;
-  g_autofree char *status = NULL;
-  const char *dirname;
-  PpdProbeResult ret = PPD_PROBE_RESULT_FAIL;
-
-  /* Verify that Intel P-State is running in active mode */
-  pstate_status_path = ppd_utils_get_sysfs_path (PSTATE_STATUS_PATH);
-  if (!g_file_get_contents (pstate_status_path, &status, NULL, NULL))
-    return ret;
-  status = g_strchomp (status);
-  if (g_strcmp0 (status, "active") != 0) {
-    g_debug ("Intel P-State is running in passive mode");
-    return ret;
-  }
-
-  policy_dir = ppd_utils_get_sysfs_path (CPUFREQ_POLICY_DIR);
-  dir = g_dir_open (policy_dir, 0, NULL);
-  if (!dir) {
-    g_debug ("Could not open %s", policy_dir);
-    return ret;
-  }
-
-  while ((dirname = g_dir_read_name (dir)) != NULL) {
-    g_autofree char *path = NULL;
-    g_autofree char *gov_path = NULL;
-    g_autoptr(GError) error = NULL;
-
-    path = g_build_filename (policy_dir,
-                             dirname,
-                             "energy_performance_preference",
-                             NULL);
-    if (!g_file_test (path, G_FILE_TEST_EXISTS))
-      continue;
-
-    /* Force a scaling_governor where the preference can be written */
-    gov_path = g_build_filename (policy_dir,
-                                 dirname,
-                                 "scaling_governor",
-                                 NULL);
-    if (!ppd_utils_write (gov_path, DEFAULT_CPU_FREQ_SCALING_GOV, &error)) {
-      g_warning ("Could not change scaling governor %s to '%s'", dirname, DEFAULT_CPU_FREQ_SCALING_GOV);
-      continue;
-    }
-
-    pstate->epp_devices = g_list_prepend (pstate->epp_devices, g_steal_pointer (&path));
-    ret = PPD_PROBE_RESULT_SUCCESS;
+  /* From arch/x86/include/asm/msr-index.h
+   * See ENERGY_PERF_BIAS_* */
+  switch (profile) {
+  case PPD_PROFILE_POWER_SAVER:
+    return "15";
+  case PPD_PROFILE_BALANCED:
+    return "6";
+  case PPD_PROFILE_PERFORMANCE:
+    return "0";
   }
 
-  return ret;
+  g_assert_not_reached ();
 }
 
+/* EPP then EPB preferences */
+static const PpdPstateGroup groups[] = {
+  { "EPP", PPD_PSTATE_POLICY_DIR, "policy", "energy_performance_preference",
+    ppd_pstate_probe_epp_policy, ppd_pstate_prepare_epp_policy,
+    ppd_pstate_profile_to_epp_pref, "EppPolicies" },
+  { "EPB", PPD_PSTATE_CPU_DIR, "cpu", "power/energy_perf_bias",
+    probe_epb_cpu, NULL, profile_to_epb_pref, "EpbCpus" },
+};
+
 static PpdProbeResult
 ppd_driver_intel_pstate_probe (PpdDriver  *driver)
 {
   PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
+  g_autoptr(GPtrArray) epp_devices = NULL;
+  g_autoptr(GPtrArray) epb_devices = NULL;
+  GPtrArray *devices[2];
   PpdProbeResult ret = PPD_PROBE_RESULT_FAIL;
+  gboolean has_epp;
 
-  ret = probe_epp (pstate);
-  if (ret == PPD_PROBE_RESULT_SUCCESS)
-    probe_epb (pstate);
-  else
-    ret = probe_epb (pstate);
+  epp_devices = g_ptr_array_new_with_free_func (g_free);
+  epb_devices = g_ptr_array_new_with_free_func (g_free);
+  devices[0] = epp_devices;
+  devices[1] = epb_devices;
 
-  if (ret != PPD_PROBE_RESULT_SUCCESS)
+  has_epp = ppd_pstate_probe_group (driver, &groups[0], PSTATE_STATUS_PATH, epp_devices);
+  if (!ppd_pstate_probe_group (driver, &groups[1], NULL, epb_devices) && !has_epp)
     goto out;
+  ret = PPD_PROBE_RESULT_SUCCESS;
+
+  /* Without EPP, only EPB preferences get written */
+  if (has_epp)
+    pstate->cpus = ppd_pstate_cpus_new (driver, groups, devices, 2);
+  else
+    pstate->cpus = ppd_pstate_cpus_new (driver, &groups[1], &devices[1], 1);
 
   if (has_turbo ()) {
     /* Monitor the first "no_turbo" */
@@ -292,87 +204,62 @@ out:
   return ret;
 }
 
-static const char *
-profile_to_epp_pref (PpdProfile profile)
+static gboolean
+ppd_driver_intel_pstate_activate_profile (PpdDriver                    *driver,
+                                          PpdProfile                   profile,
+                                          PpdProfileActivationReason   reason,
+                                          GError                     **error)
 {
-  /* Note that we don't check "energy_performance_available_preferences"
-   * as all the values are always available */
-  switch (profile) {
-  case PPD_PROFILE_POWER_SAVER:
-    return "power";
-  case PPD_PROFILE_BALANCED:
-    return "balance_performance";
-  case PPD_PROFILE_PERFORMANCE:
-    return "performance";
-  }
-
-  g_assert_not_reached ();
-}
+  PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
 
-static const char *
-profile_to_epb_pref (PpdProfile profile)
-{
-  /* From arch/x86/include/asm/msr-index.h
-   * See ENERGY_PERF_BIAS_* */
-  switch (profile) {
-  case PPD_PROFILE_POWER_SAVER:
-    return "15";
-  case PPD_PROFILE_BALANCED:
-    return "6";
-  case PPD_PROFILE_PERFORMANCE:
-    return "0";
-  }
+  g_return_val_if_fail (pstate->cpus != NULL, FALSE);
 
-  g_assert_not_reached ();
+  return ppd_pstate_cpus_activate_profile (pstate->cpus, profile, error);
 }
 
-static gboolean
-apply_pref_to_devices (GList       *devices,
-                       const char  *pref,
-                       GError     **error)
+static void
+ppd_driver_intel_pstate_activate_profile_async (PpdDriver                   *driver,
+                                                PpdProfile                   profile,
+                                                PpdProfileActivationReason   reason,
+                                                GCancellable                *cancellable,
+                                                GAsyncReadyCallback          callback,
+                                                gpointer                     user_data)
 {
-  gboolean ret = TRUE;
-  GList *l;
-
-  for (l = devices; l != NULL; l = l->next) {
-    const char *path = l->data;
+  PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
 
-    ret = ppd_utils_write (path, pref, error);
-    if (!ret)
-      break;
+  if (pstate->cpus == NULL) {
+    g_task_report_new_error (driver, callback, user_data,
+                             ppd_driver_intel_pstate_activate_profile_async,
+                             G_IO_ERROR, G_IO_ERROR_NOT_FOUND,
+                             "No energy preference to write");
+    return;
   }
 
-  return ret;
+  ppd_pstate_cpus_activate_profile_async (pstate->cpus, profile, cancellable,
+                                          callback, user_data);
 }
 
 static gboolean
-ppd_driver_intel_pstate_activate_profile (PpdDriver                    *driver,
-                                          PpdProfile                   profile,
-                                          PpdProfileActivationReason   reason,
-                                          GError                     **error)
+ppd_driver_intel_pstate_activate_profile_finish (PpdDriver     *driver,
+                                                 GAsyncResult  *result,
+                                                 GError       **error)
 {
   PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
-  gboolean ret = FALSE;
-  const char *pref;
 
-  g_return_val_if_fail (pstate->epp_devices != NULL ||
-                        pstate->epb_devices, FALSE);
+  if (pstate->cpus == NULL)
+    return g_task_propagate_boolean (G_TASK (result), error);
 
-  if (pstate->epp_devices) {
-    pref = profile_to_epp_pref (profile);
-    ret = apply_pref_to_devices (pstate->epp_devices, pref, error);
-    if (!ret)
-      return ret;
-  }
-  if (pstate->epb_devices) {
-    pref = profile_to_epb_pref (profile);
-    ret = apply_pref_to_devices (pstate->epb_devices, pref, error);
-  }
+  return ppd_pstate_cpus_activate_profile_finish (pstate->cpus, result, error);
+}
 
-  if (ret)
-    pstate->activated_profile = profile;
+static void
+ppd_driver_intel_pstate_rollback_profile (PpdDriver  *driver,
+                                         PpdProfile  profile)
+{
+  PpdDriverIntelPstate *pstate = PPD_DRIVER_INTEL_PSTATE (driver);
 
-  return ret;
+  if (pstate->cpus != NULL)
+    ppd_pstate_cpus_rollback_profile (pstate->cpus, profile);
 }
 
 static void
@@ -381,11 +268,9 @@ ppd_driver_intel_pstate_finalize (GObject *object)
   PpdDriverIntelPstate *driver;
 
   driver = PPD_DRIVER_INTEL_PSTATE (object);
-  g_clear_list (&driver->epp_devices, g_free);
-  g_clear_list (&driver->epb_devices, g_free);
+  g_clear_pointer (&driver->cpus, ppd_pstate_cpus_free);
   g_clear_pointer (&driver->no_turbo_path, g_free);
   g_clear_object (&driver->no_turbo_mon);
-  g_clear_object (&driver->logind_proxy);
   G_OBJECT_CLASS (ppd_driver_intel_pstate_parent_class)->finalize (object);
 }
 
@@ -402,6 +287,9 @@ ppd_driver_intel_pstate_class_init (PpdDriverIntelPstateClass *klass)
   driver_class = PPD_DRIVER_CLASS(klass);
   driver_class->probe = ppd_driver_intel_pstate_probe;
   driver_class->activate_profile = ppd_driver_intel_pstate_activate_profile;
+  driver_class->activate_profile_async = ppd_driver_intel_pstate_activate_profile_async;
+  driver_class->activate_profile_finish = ppd_driver_intel_pstate_activate_profile_finish;
+  driver_class->rollback_profile = ppd_driver_intel_pstate_rollback_profile;
 }
 
 static void
@@ -30,6 +30,7 @@ struct _PpdDriverPlatformProfile
   GFileMonitor *lapmode_mon;
   GFileMonitor *acpi_platform_profile_mon;
   guint acpi_platform_profile_changed_id;
+  char *cached_path;
 };
 
 G_DEFINE_TYPE (PpdDriverPlatformProfile, ppd_driver_platform_profile, PPD_TYPE_DRIVER)
@@ -176,8 +177,13 @@ update_dytc_lapmode_state (PpdDriverPlatformProfile *self)
 static void
 update_acpi_platform_profile_state (PpdDriverPlatformProfile *self)
 {
+  g_autofree char *platform_profile_path = NULL;
   PpdProfile new_profile;
 
+  /* The profile might have been changed behind our back */
+  platform_profile_path = ppd_utils_get_sysfs_path (ACPI_PLATFORM_PROFILE_PATH);
+  ppd_utils_sysfs_cache_verify (platform_profile_path);
+
   new_profile = read_platform_profile ();
   if (new_profile == PPD_PROFILE_UNSET ||
       new_profile == self->acpi_platform_profile)
@@ -255,6 +261,92 @@ ppd_driver_platform_profile_activate_profile (PpdDriver                   *drive
   return TRUE;
 }
 
+static void
+platform_profile_written_cb (GObject      *source_object,
+                             GAsyncResult *res,
+                             gpointer      user_data)
+{
+  g_autoptr(GTask) task = user_data;
+  PpdDriverPlatformProfile *self = g_task_get_source_object (task);
+  GError *error = NULL;
+
+  if (!ppd_utils_write_finish (res, &error)) {
+    g_debug ("Failed to write to acpi_platform_profile: %s", error->message);
+    self->acpi_platform_profile = GPOINTER_TO_UINT (g_task_get_task_data (task));
+    g_task_return_error (task, error);
+    return;
+  }
+
+  g_debug ("Successfully switched to profile %s",
+           ppd_profile_to_str (self->acpi_platform_profile));
+  g_task_return_boolean (task, TRUE);
+}
+
+static void
+ppd_driver_platform_profile_activate_profile_async (PpdDriver                   *driver,
+                                                    PpdProfile                   profile,
+                                                    PpdProfileActivationReason   reason,
+                                                    GCancellable                *cancellable,
+                                                    GAsyncReadyCallback          callback,
+                                                    gpointer                     user_data)
+{
+  PpdDriverPlatformProfile *self = PPD_DRIVER_PLATFORM_PROFILE (driver);
+  g_autofree char *platform_profile_path = NULL;
+  g_autoptr(GTask) task = NULL;
+  const char *platform_profile_value;
+
+  task = g_task_new (driver, cancellable, callback, user_data);
+  g_task_set_source_tag (task, ppd_driver_platform_profile_activate_profile_async);
+
+  if (self->acpi_platform_profile == profile) {
+    g_debug ("Can't switch to %s mode, already there",
+             ppd_profile_to_str (profile));
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  platform_profile_value = profile_to_acpi_platform_profile_value (self, profile);
+  if (self->acpi_platform_profile == acpi_platform_profile_value_to_profile (platform_profile_value)) {
+    g_debug ("Not switching to platform_profile %s, emulating for %s, already there",
+             platform_profile_value,
+             ppd_profile_to_str (profile));
+    g_task_return_boolean (task, TRUE);
+    return;
+  }
+
+  /* Update the profile before the write completes, so that the file
+   * monitor doesn't mistake our own change for a firmware one. It is
+   * restored in rollback_profile() if the transition fails. */
+  g_task_set_task_data (task, GUINT_TO_POINTER (self->acpi_platform_profile), NULL);
+  self->acpi_platform_profile = profile;
+
+  platform_profile_path = ppd_utils_get_sysfs_path (ACPI_PLATFORM_PROFILE_PATH);
+  ppd_utils_write_async (platform_profile_path, platform_profile_value, cancellable,
+                         platform_profile_written_cb, g_steal_pointer (&task));
+}
+
+static gboolean
+ppd_driver_platform_profile_activate_profile_finish (PpdDriver     *driver,
+                                                     GAsyncResult  *result,
+                                                     GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, driver), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+static void
+ppd_driver_platform_profile_rollback_profile (PpdDriver  *driver,
+                                              PpdProfile  profile)
+{
+  PpdDriverPlatformProfile *self = PPD_DRIVER_PLATFORM_PROFILE (driver);
+
+  g_debug ("Switch to profile %s was undone, back to %s",
+           ppd_profile_to_str (self->acpi_platform_profile),
+           ppd_profile_to_str (profile));
+  self->acpi_platform_profile = profile;
+}
+
 static int
 find_dytc (GUdevDevice *dev,
            gpointer     user_data)
@@ -268,12 +360,44 @@ find_dytc (GUdevDevice *dev,
   return 0;
 }
 
+static GUdevDevice *
+find_dytc_device (void)
+{
+  g_auto(GStrv) cached = NULL;
+  const char *paths[] = { NULL, NULL };
+  GUdevDevice *device;
+
+  /* Enumerating the platform devices is slow, so use the one found
+   * on the previous run if it is still there */
+  cached = ppd_utils_probe_cache_lookup ("platform_profile", "DytcDevice");
+  if (cached != NULL && cached[0] != NULL) {
+    device = ppd_utils_get_device (cached[0]);
+    if (device != NULL && find_dytc (device, NULL) == 0)
+      return device;
+    g_debug ("Cached dytc device '%s' went away, probing again", cached[0]);
+    g_clear_object (&device);
+  }
+
+  device = ppd_utils_find_device ("platform",
+                                  (GCompareFunc) find_dytc,
+                                  NULL);
+
+  /* Not finding one isn't cached, as thinkpad_acpi can load later */
+  if (device != NULL) {
+    paths[0] = g_udev_device_get_sysfs_path (device);
+    ppd_utils_probe_cache_store ("platform_profile", "DytcDevice", paths);
+  }
+
+  return device;
+}
+
 static PpdProbeResult
 ppd_driver_platform_profile_probe (PpdDriver  *driver)
 {
   PpdDriverPlatformProfile *self = PPD_DRIVER_PLATFORM_PROFILE (driver);
   g_autoptr(GFile) acpi_platform_profile = NULL;
   g_autofree char *platform_profile_path = NULL;
+  g_autoptr(GError) error = NULL;
 
   g_return_val_if_fail (self->probe_result == PPD_PROBE_RESULT_UNSET, PPD_PROBE_RESULT_FAIL);
 
@@ -304,10 +428,13 @@ ppd_driver_platform_profile_probe (PpdDriver  *driver)
     return self->probe_result;
   }
 
+  if (ppd_utils_sysfs_cache_open (platform_profile_path, &error))
+    self->cached_path = g_strdup (platform_profile_path);
+  else
+    g_debug ("Could not cache handle for '%s': %s", platform_profile_path, error->message);
+
   /* Lenovo-specific proximity sensor */
-  self->device = ppd_utils_find_device ("platform",
-                                        (GCompareFunc) find_dytc,
-                                        NULL);
+  self->device = find_dytc_device ();
   if (!self->device)
     goto out;
 
@@ -332,6 +459,9 @@ ppd_driver_platform_profile_finalize (GObject *object)
   PpdDriverPlatformProfile *driver;
 
   driver = PPD_DRIVER_PLATFORM_PROFILE (object);
+  if (driver->cached_path != NULL)
+    ppd_utils_sysfs_cache_close (driver->cached_path);
+  g_clear_pointer (&driver->cached_path, g_free);
   g_clear_pointer (&driver->profile_choices, g_strfreev);
   g_clear_object (&driver->device);
   g_clear_object (&driver->lapmode_mon);
@@ -352,6 +482,9 @@ ppd_driver_platform_profile_class_init (PpdDriverPlatformProfileClass *klass)
   driver_class = PPD_DRIVER_CLASS(klass);
   driver_class->probe = ppd_driver_platform_profile_probe;
   driver_class->activate_profile = ppd_driver_platform_profile_activate_profile;
+  driver_class->activate_profile_async = ppd_driver_platform_profile_activate_profile_async;
+  driver_class->activate_profile_finish = ppd_driver_platform_profile_activate_profile_finish;
+  driver_class->rollback_profile = ppd_driver_platform_profile_rollback_profile;
 }
 
 static void
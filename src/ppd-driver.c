@@ -9,6 +9,7 @@
 
 #include "ppd-driver.h"
 #include "ppd-enums.h"
+#include "ppd-utils.h"
 
 /**
  * SECTION:ppd-driver
@@ -237,6 +238,82 @@ ppd_driver_activate_profile (PpdDriver                   *driver,
   return PPD_DRIVER_GET_CLASS (driver)->activate_profile (driver, profile, reason, error);
 }
 
+typedef struct {
+  PpdProfile profile;
+  PpdProfileActivationReason reason;
+} ActivateData;
+
+static void
+activate_profile_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  ActivateData *data = task_data;
+  GError *error = NULL;
+
+  if (ppd_driver_activate_profile (source_object, data->profile, data->reason, &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+void
+ppd_driver_activate_profile_async (PpdDriver                   *driver,
+                                   PpdProfile                   profile,
+                                   PpdProfileActivationReason   reason,
+                                   GCancellable                *cancellable,
+                                   GAsyncReadyCallback          callback,
+                                   gpointer                     user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  ActivateData *data;
+
+  g_return_if_fail (PPD_IS_DRIVER (driver));
+  g_return_if_fail (ppd_profile_has_single_flag (profile));
+
+  if (PPD_DRIVER_GET_CLASS (driver)->activate_profile_async) {
+    PPD_DRIVER_GET_CLASS (driver)->activate_profile_async (driver, profile, reason,
+                                                           cancellable, callback, user_data);
+    return;
+  }
+
+  /* Fall back to the synchronous implementation, in a thread
+   * that writes as part of the caller's write context */
+  task = g_task_new (driver, cancellable, callback, user_data);
+  g_task_set_source_tag (task, ppd_driver_activate_profile_async);
+  data = g_new0 (ActivateData, 1);
+  data->profile = profile;
+  data->reason = reason;
+  g_task_set_task_data (task, data, g_free);
+  ppd_utils_task_run_in_thread (task, activate_profile_thread);
+}
+
+gboolean
+ppd_driver_activate_profile_finish (PpdDriver     *driver,
+                                    GAsyncResult  *result,
+                                    GError       **error)
+{
+  g_return_val_if_fail (PPD_IS_DRIVER (driver), FALSE);
+
+  if (g_async_result_is_tagged (result, ppd_driver_activate_profile_async))
+    return g_task_propagate_boolean (G_TASK (result), error);
+
+  return PPD_DRIVER_GET_CLASS (driver)->activate_profile_finish (driver, result, error);
+}
+
+void
+ppd_driver_rollback_profile (PpdDriver  *driver,
+                             PpdProfile  profile)
+{
+  g_return_if_fail (PPD_IS_DRIVER (driver));
+
+  if (!PPD_DRIVER_GET_CLASS (driver)->rollback_profile)
+    return;
+
+  PPD_DRIVER_GET_CLASS (driver)->rollback_profile (driver, profile);
+}
+
 const char *
 ppd_driver_get_driver_name (PpdDriver *driver)
 {
@@ -9,7 +9,7 @@
 
 #pragma once
 
-#include <glib-object.h>
+#include <gio/gio.h>
 #include "ppd-profile.h"
 
 #define PPD_TYPE_DRIVER (ppd_driver_get_type())
@@ -63,6 +63,14 @@ typedef enum{
  * @parent_class: The parent class.
  * @probe: Called by the daemon on startup.
  * @activate_profile: Called by the daemon for every profile change.
+ * @activate_profile_async: Called by the daemon for every profile change
+ *   instead of @activate_profile if implemented, so that slow writes
+ *   don't block the daemon. Otherwise, @activate_profile is called from
+ *   a worker thread.
+ * @activate_profile_finish: Finishes @activate_profile_async.
+ * @rollback_profile: Called by the daemon when the writes of a profile
+ *   change were undone, so that the driver's state matches @profile,
+ *   which the hardware is back in.
  *
  * New profile drivers should derive from #PpdDriver and implement
  * at least one of probe() and @activate_profile.
@@ -71,17 +79,34 @@ struct _PpdDriverClass
 {
   GObjectClass   parent_class;
 
-  PpdProbeResult (* probe)            (PpdDriver                   *driver);
-  gboolean       (* activate_profile) (PpdDriver                   *driver,
-                                       PpdProfile                   profile,
-                                       PpdProfileActivationReason   reason,
-                                       GError                     **error);
+  PpdProbeResult (* probe)                   (PpdDriver                   *driver);
+  gboolean       (* activate_profile)        (PpdDriver                   *driver,
+                                              PpdProfile                   profile,
+                                              PpdProfileActivationReason   reason,
+                                              GError                     **error);
+  void           (* activate_profile_async)  (PpdDriver                   *driver,
+                                              PpdProfile                   profile,
+                                              PpdProfileActivationReason   reason,
+                                              GCancellable                *cancellable,
+                                              GAsyncReadyCallback          callback,
+                                              gpointer                     user_data);
+  gboolean       (* activate_profile_finish) (PpdDriver                   *driver,
+                                              GAsyncResult                *result,
+                                              GError                     **error);
+  void           (* rollback_profile)        (PpdDriver                   *driver,
+                                              PpdProfile                   profile);
 };
 
 #ifndef __GTK_DOC_IGNORE__
 PpdProbeResult ppd_driver_probe (PpdDriver *driver);
 gboolean ppd_driver_activate_profile (PpdDriver *driver,
   PpdProfile profile, PpdProfileActivationReason reason, GError **error);
+void ppd_driver_activate_profile_async (PpdDriver *driver,
+  PpdProfile profile, PpdProfileActivationReason reason, GCancellable *cancellable,
+  GAsyncReadyCallback callback, gpointer user_data);
+gboolean ppd_driver_activate_profile_finish (PpdDriver *driver,
+  GAsyncResult *result, GError **error);
+void ppd_driver_rollback_profile (PpdDriver *driver, PpdProfile profile);
 const char *ppd_driver_get_driver_name (PpdDriver *driver);
 PpdProfile ppd_driver_get_profiles (PpdDriver *driver);
 const char *ppd_driver_get_performance_degraded (PpdDriver *driver);
@@ -0,0 +1,510 @@
+/*
+ * Copyright (c) 2020 Bastien Nocera <hadess@hadess.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#include <gudev/gudev.h>
+
+#include "ppd-pstate.h"
+
+#define DEFAULT_CPU_FREQ_SCALING_GOV "powersave"
+
+/* The preferences of the intel_pstate and amd_pstate drivers, one write
+ * plan group per #PpdPstateGroup, kept up to date as CPUs get hotplugged */
+struct _PpdPstateCpus {
+  PpdDriver *driver; /* owns this */
+  const PpdPstateGroup *groups;
+  guint n_groups;
+  GUdevClient *cpu_client;
+
+  GMutex lock; /* protects the following from activation threads */
+  PpdWritePlan *write_plan;
+  GPtrArray *unprepared; /* of Preparation, until the first activation */
+  GPtrArray *prepared; /* by the last activation, until it's committed */
+  PpdProfile activated_profile;
+  gboolean activating;
+};
+
+typedef struct {
+  PpdPstatePrepareFunc func;
+  char *path;
+} Preparation;
+
+static void
+preparation_free (Preparation *preparation)
+{
+  g_free (preparation->path);
+  g_free (preparation);
+}
+
+static gboolean
+scaling_governor_is_default (const char *gov_path)
+{
+  g_autofree char *contents = NULL;
+
+  if (!g_file_get_contents (gov_path, &contents, NULL, NULL))
+    return FALSE;
+  return g_strcmp0 (g_strchomp (contents), DEFAULT_CPU_FREQ_SCALING_GOV) == 0;
+}
+
+/* Returns the path to the EPP preference of the @dirname policy in
+ * @policy_dir, or %NULL if it doesn't have one */
+char *
+ppd_pstate_probe_epp_policy (const char *policy_dir,
+                             const char *dirname)
+{
+  g_autofree char *path = NULL;
+  g_autoptr(GError) error = NULL;
+
+  path = g_build_filename (policy_dir,
+                           dirname,
+                           "energy_performance_preference",
+                           NULL);
+  if (!g_file_test (path, G_FILE_TEST_EXISTS))
+    return NULL;
+
+  if (!ppd_utils_sysfs_cache_open (path, &error))
+    g_debug ("Could not cache handle for '%s': %s", path, error->message);
+
+  return g_steal_pointer (&path);
+}
+
+/* Forces a scaling_governor where the EPP preference at @path can be
+ * written. This isn't done when probing, as drivers that don't get
+ * picked would leave it changed. */
+gboolean
+ppd_pstate_prepare_epp_policy (const char  *path,
+                               GError     **error)
+{
+  g_autofree char *policy_dir = NULL;
+  g_autofree char *gov_path = NULL;
+
+  policy_dir = g_path_get_dirname (path);
+  gov_path = g_build_filename (policy_dir, "scaling_governor", NULL);
+  if (scaling_governor_is_default (gov_path))
+    return TRUE;
+
+  if (!ppd_utils_write (gov_path, DEFAULT_CPU_FREQ_SCALING_GOV, error)) {
+    g_warning ("Could not change scaling governor %s to '%s'", policy_dir, DEFAULT_CPU_FREQ_SCALING_GOV);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+const char *
+ppd_pstate_profile_to_epp_pref (PpdProfile profile)
+{
+  /* Note that we don't check "energy_performance_available_preferences"
+   * as all the values are always available */
+  switch (profile) {
+  case PPD_PROFILE_POWER_SAVER:
+    return "power";
+  case PPD_PROFILE_BALANCED:
+    return "balance_performance";
+  case PPD_PROFILE_PERFORMANCE:
+    return "performance";
+  }
+
+  g_assert_not_reached ();
+}
+
+/* Probes the @dirnames of @dir found on a previous run, and fails,
+ * leaving @devices empty and closing their handles, if any of them
+ * went away */
+static gboolean
+probe_cached_dirs (const char         *dir,
+                   char              **dirnames,
+                   PpdPstateProbeFunc  probe_func,
+                   GPtrArray          *devices)
+{
+  guint i;
+
+  if (dirnames == NULL || dirnames[0] == NULL)
+    return FALSE;
+
+  for (i = 0; dirnames[i] != NULL; i++) {
+    char *path;
+
+    path = probe_func (dir, dirnames[i]);
+    if (path == NULL) {
+      guint j;
+
+      /* The scan opens them again */
+      g_debug ("Cached '%s' went away, probing again", dirnames[i]);
+      for (j = 0; j < devices->len; j++)
+        ppd_utils_sysfs_cache_close (g_ptr_array_index (devices, j));
+      g_ptr_array_set_size (devices, 0);
+      return FALSE;
+    }
+    g_ptr_array_add (devices, path);
+  }
+
+  return TRUE;
+}
+
+/* Probes every entry of @dir, and saves the ones that matched as
+ * @cache_key of @driver_name in the probe cache */
+static gboolean
+scan_dirs (const char         *driver_name,
+           const char         *dir,
+           PpdPstateProbeFunc  probe_func,
+           const char         *cache_key,
+           GPtrArray          *devices)
+{
+  g_autoptr(GDir) gdir = NULL;
+  g_autoptr(GPtrArray) dirnames = NULL;
+  const char *dirname;
+
+  gdir = g_dir_open (dir, 0, NULL);
+  if (!gdir) {
+    g_debug ("Could not open %s", dir);
+    return FALSE;
+  }
+
+  dirnames = g_ptr_array_new_with_free_func (g_free);
+  while ((dirname = g_dir_read_name (gdir)) != NULL) {
+    char *path;
+
+    path = probe_func (dir, dirname);
+    if (path == NULL)
+      continue;
+
+    g_ptr_array_add (devices, path);
+    g_ptr_array_add (dirnames, g_strdup (dirname));
+  }
+
+  if (dirnames->len == 0)
+    return FALSE;
+
+  g_ptr_array_add (dirnames, NULL);
+  ppd_utils_probe_cache_store (driver_name, cache_key,
+                               (const char * const *) dirnames->pdata);
+  return TRUE;
+}
+
+/* Fills @devices with the preferences of @group, from the probe cache
+ * if they are all still there, or scanning for them otherwise. If set,
+ * @status_path needs to read "active" for the directories to be scanned.
+ * The pstate mode is part of the probe cache's fingerprint, so cached
+ * entries mean that it is still in active mode. */
+gboolean
+ppd_pstate_probe_group (PpdDriver            *driver,
+                        const PpdPstateGroup *group,
+                        const char           *status_path,
+                        GPtrArray            *devices)
+{
+  const char *driver_name = ppd_driver_get_driver_name (driver);
+  g_autofree char *dir = NULL;
+  g_auto(GStrv) cached = NULL;
+
+  dir = ppd_utils_get_sysfs_path (group->dir);
+  cached = ppd_utils_probe_cache_lookup (driver_name, group->cache_key);
+  if (probe_cached_dirs (dir, cached, group->probe_func, devices)) {
+    g_debug ("Using cached %s preferences", group->name);
+    return TRUE;
+  }
+
+  if (status_path != NULL) {
+    g_autofree char *path = NULL;
+    g_autofree char *status = NULL;
+
+    path = ppd_utils_get_sysfs_path (status_path);
+    if (!g_file_get_contents (path, &status, NULL, NULL))
+      return FALSE;
+    if (g_strcmp0 (g_strchomp (status), "active") != 0) {
+      g_debug ("%s is not running in active mode", driver_name);
+      return FALSE;
+    }
+  }
+
+  return scan_dirs (driver_name, dir, group->probe_func, group->cache_key, devices);
+}
+
+static void
+add_preparation (PpdPstateCpus *cpus,
+                 guint          group,
+                 const char    *path)
+{
+  Preparation *preparation;
+
+  if (cpus->groups[group].prepare_func == NULL)
+    return;
+
+  preparation = g_new0 (Preparation, 1);
+  preparation->func = cpus->groups[group].prepare_func;
+  preparation->path = g_strdup (path);
+  g_ptr_array_add (cpus->unprepared, preparation);
+}
+
+static void
+add_cpu_pref (PpdPstateCpus *cpus,
+              guint          group,
+              const char    *dir,
+              const char    *dirname,
+              const char    *path)
+{
+  g_autofree char *probed_path = NULL;
+  g_autoptr(GError) error = NULL;
+  PpdWritePlan *plan;
+  PpdProfile profile;
+
+  /* "add" and "online" both come through for the same CPU, and
+   * probing caches a handle that the plan only closes once */
+  if (ppd_utils_write_plan_contains (cpus->write_plan, path))
+    return;
+  probed_path = cpus->groups[group].probe_func (dir, dirname);
+  if (probed_path == NULL)
+    return;
+
+  g_debug ("Adding '%s' for hotplugged CPU", probed_path);
+  g_mutex_lock (&cpus->lock);
+  /* Once activated, the CPU needs preparing before an activation
+   * thread can write to it */
+  if (cpus->unprepared != NULL) {
+    add_preparation (cpus, group, probed_path);
+  } else if (cpus->groups[group].prepare_func != NULL &&
+             !cpus->groups[group].prepare_func (probed_path, NULL)) {
+    g_mutex_unlock (&cpus->lock);
+    ppd_utils_sysfs_cache_close (probed_path);
+    return;
+  }
+  plan = ppd_utils_write_plan_add (cpus->write_plan, group, probed_path);
+  ppd_utils_write_plan_unref (cpus->write_plan);
+  cpus->write_plan = plan;
+  /* A running activation applies the new plan before finishing */
+  profile = cpus->activating ? PPD_PROFILE_UNSET : cpus->activated_profile;
+  g_mutex_unlock (&cpus->lock);
+
+  if (profile == PPD_PROFILE_UNSET)
+    return;
+
+  /* Only the new CPU needs the current profile */
+  if (!ppd_utils_write (probed_path, cpus->groups[group].value_func (profile), &error))
+    g_warning ("Could not apply profile to hotplugged CPU: %s", error->message);
+}
+
+static void
+remove_cpu_pref (PpdPstateCpus *cpus,
+                 const char    *path)
+{
+  PpdWritePlan *plan;
+
+  if (!ppd_utils_write_plan_contains (cpus->write_plan, path))
+    return;
+
+  g_debug ("Removing '%s' for unplugged CPU", path);
+  g_mutex_lock (&cpus->lock);
+  plan = ppd_utils_write_plan_remove (cpus->write_plan, path);
+  ppd_utils_write_plan_unref (cpus->write_plan);
+  cpus->write_plan = plan;
+  g_mutex_unlock (&cpus->lock);
+  ppd_utils_sysfs_cache_close (path);
+}
+
+static void
+cpu_uevent_cb (GUdevClient *client,
+               gchar       *action,
+               GUdevDevice *device,
+               gpointer     user_data)
+{
+  PpdPstateCpus *cpus = user_data;
+  const char *number;
+  guint i;
+
+  number = g_udev_device_get_number (device);
+  if (number == NULL || *number == '\0')
+    return;
+
+  /* pstate drivers have one policy per CPU, with the same number */
+  for (i = 0; i < cpus->n_groups; i++) {
+    const PpdPstateGroup *group = &cpus->groups[i];
+    g_autofree char *dir = NULL;
+    g_autofree char *dirname = NULL;
+    g_autofree char *path = NULL;
+
+    dir = ppd_utils_get_sysfs_path (group->dir);
+    dirname = g_strconcat (group->prefix, number, NULL);
+    path = g_build_filename (dir, dirname, group->attribute, NULL);
+
+    if (g_strcmp0 (action, "add") == 0 ||
+        g_strcmp0 (action, "online") == 0)
+      add_cpu_pref (cpus, i, dir, dirname, path);
+    else if (g_strcmp0 (action, "remove") == 0 ||
+             g_strcmp0 (action, "offline") == 0)
+      remove_cpu_pref (cpus, path);
+  }
+}
+
+/* Takes over the probed @devices of each of the @groups, which must
+ * outlive @driver, and follows CPUs being hotplugged rather than
+ * probing again */
+PpdPstateCpus *
+ppd_pstate_cpus_new (PpdDriver             *driver,
+                     const PpdPstateGroup  *groups,
+                     GPtrArray            **devices,
+                     guint                  n_groups)
+{
+  const gchar * const subsystems[] = { "cpu", NULL };
+  g_autofree PpdWritePlanGroup *plan_groups = NULL;
+  PpdPstateCpus *cpus;
+  guint i, j;
+
+  plan_groups = g_new0 (PpdWritePlanGroup, n_groups);
+  for (i = 0; i < n_groups; i++) {
+    plan_groups[i].filenames = devices[i];
+    plan_groups[i].value_func = groups[i].value_func;
+  }
+
+  cpus = g_new0 (PpdPstateCpus, 1);
+  cpus->driver = driver;
+  cpus->groups = groups;
+  cpus->n_groups = n_groups;
+  g_mutex_init (&cpus->lock);
+  cpus->write_plan = ppd_utils_write_plan_new (plan_groups, n_groups);
+  cpus->activated_profile = PPD_PROFILE_UNSET;
+  cpus->unprepared = g_ptr_array_new_with_free_func ((GDestroyNotify) preparation_free);
+  for (i = 0; i < n_groups; i++) {
+    for (j = 0; j < devices[i]->len; j++)
+      add_preparation (cpus, i, g_ptr_array_index (devices[i], j));
+  }
+
+  cpus->cpu_client = g_udev_client_new (subsystems);
+  g_signal_connect (G_OBJECT (cpus->cpu_client), "uevent",
+                    G_CALLBACK (cpu_uevent_cb), cpus);
+
+  return cpus;
+}
+
+void
+ppd_pstate_cpus_free (PpdPstateCpus *cpus)
+{
+  if (cpus == NULL)
+    return;
+
+  g_clear_object (&cpus->cpu_client);
+  ppd_utils_write_plan_close_handles (cpus->write_plan);
+  ppd_utils_write_plan_unref (cpus->write_plan);
+  g_clear_pointer (&cpus->unprepared, g_ptr_array_unref);
+  g_clear_pointer (&cpus->prepared, g_ptr_array_unref);
+  g_mutex_clear (&cpus->lock);
+  g_free (cpus);
+}
+
+/* Applies the current write plan for @profile until CPUs stop being
+ * hotplugged, so that none of them misses it. This can be called from
+ * a thread. */
+gboolean
+ppd_pstate_cpus_activate_profile (PpdPstateCpus  *cpus,
+                                  PpdProfile      profile,
+                                  GError        **error)
+{
+  g_autoptr(PpdWritePlan) plan = NULL;
+  g_autoptr(GPtrArray) unprepared = NULL;
+  guint i;
+
+  /* Transitions are serialized, so the previous one was committed
+   * if it wasn't rolled back by now */
+  g_mutex_lock (&cpus->lock);
+  cpus->activating = TRUE;
+  g_clear_pointer (&cpus->prepared, g_ptr_array_unref);
+  unprepared = g_steal_pointer (&cpus->unprepared);
+  g_mutex_unlock (&cpus->lock);
+
+  /* Those that fail get reported when the preference is written */
+  for (i = 0; unprepared != NULL && i < unprepared->len; i++) {
+    Preparation *preparation = g_ptr_array_index (unprepared, i);
+
+    preparation->func (preparation->path, NULL);
+  }
+
+  g_mutex_lock (&cpus->lock);
+  cpus->prepared = g_steal_pointer (&unprepared);
+  while (plan != cpus->write_plan) {
+    g_clear_pointer (&plan, ppd_utils_write_plan_unref);
+    plan = ppd_utils_write_plan_ref (cpus->write_plan);
+    g_mutex_unlock (&cpus->lock);
+
+    if (!ppd_utils_write_plan_apply (plan, profile, error)) {
+      g_mutex_lock (&cpus->lock);
+      cpus->activating = FALSE;
+      g_mutex_unlock (&cpus->lock);
+      return FALSE;
+    }
+
+    g_mutex_lock (&cpus->lock);
+  }
+  cpus->activating = FALSE;
+  cpus->activated_profile = profile;
+  g_mutex_unlock (&cpus->lock);
+
+  return TRUE;
+}
+
+typedef struct {
+  PpdPstateCpus *cpus; /* kept alive by the driver, the task's source */
+  PpdProfile profile;
+} ActivateData;
+
+static void
+activate_profile_thread (GTask        *task,
+                         gpointer      source_object,
+                         gpointer      task_data,
+                         GCancellable *cancellable)
+{
+  ActivateData *data = task_data;
+  GError *error = NULL;
+
+  if (ppd_pstate_cpus_activate_profile (data->cpus, data->profile, &error))
+    g_task_return_boolean (task, TRUE);
+  else
+    g_task_return_error (task, error);
+}
+
+void
+ppd_pstate_cpus_activate_profile_async (PpdPstateCpus       *cpus,
+                                        PpdProfile           profile,
+                                        GCancellable        *cancellable,
+                                        GAsyncReadyCallback  callback,
+                                        gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  ActivateData *data;
+
+  task = g_task_new (cpus->driver, cancellable, callback, user_data);
+  g_task_set_source_tag (task, ppd_pstate_cpus_activate_profile_async);
+  data = g_new0 (ActivateData, 1);
+  data->cpus = cpus;
+  data->profile = profile;
+  g_task_set_task_data (task, data, g_free);
+  ppd_utils_task_run_in_thread (task, activate_profile_thread);
+}
+
+gboolean
+ppd_pstate_cpus_activate_profile_finish (PpdPstateCpus  *cpus,
+                                         GAsyncResult   *result,
+                                         GError        **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, cpus->driver), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
+/* Hotplugged CPUs get @profile again once a change was undone, and
+ * preparations it undid are done again on the next activation */
+void
+ppd_pstate_cpus_rollback_profile (PpdPstateCpus *cpus,
+                                  PpdProfile     profile)
+{
+  g_mutex_lock (&cpus->lock);
+  cpus->activated_profile = profile;
+  if (cpus->prepared != NULL) {
+    g_clear_pointer (&cpus->unprepared, g_ptr_array_unref);
+    cpus->unprepared = g_steal_pointer (&cpus->prepared);
+  }
+  g_mutex_unlock (&cpus->lock);
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2020 Bastien Nocera <hadess@hadess.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include "ppd-driver.h"
+#include "ppd-utils.h"
+
+#define PPD_PSTATE_CPU_DIR "/sys/devices/system/cpu/"
+#define PPD_PSTATE_POLICY_DIR "/sys/devices/system/cpu/cpufreq/"
+
+/* Returns the path to the preference in the @dirname entry of @dir, with
+ * its handle cached, or %NULL if it doesn't have one that can be written */
+typedef char * (*PpdPstateProbeFunc) (const char *dir,
+                                      const char *dirname);
+
+/* Gets the preference at @path ready to be written, before the first
+ * profile is applied to it */
+typedef gboolean (*PpdPstatePrepareFunc) (const char  *path,
+                                          GError     **error);
+
+/* Per-CPU @name preferences written by a pstate driver, in the @prefix
+ * followed by the CPU number entries of @dir, relative to the sysfs root */
+typedef struct {
+  const char *name;
+  const char *dir;
+  const char *prefix;
+  const char *attribute;
+  PpdPstateProbeFunc probe_func;
+  PpdPstatePrepareFunc prepare_func;
+  PpdWritePlanValueFunc value_func;
+  const char *cache_key;
+} PpdPstateGroup;
+
+typedef struct _PpdPstateCpus PpdPstateCpus;
+
+char *ppd_pstate_probe_epp_policy (const char *policy_dir,
+                                   const char *dirname);
+gboolean ppd_pstate_prepare_epp_policy (const char  *path,
+                                        GError     **error);
+const char *ppd_pstate_profile_to_epp_pref (PpdProfile profile);
+gboolean ppd_pstate_probe_group (PpdDriver            *driver,
+                                 const PpdPstateGroup *group,
+                                 const char           *status_path,
+                                 GPtrArray            *devices);
+PpdPstateCpus *ppd_pstate_cpus_new (PpdDriver             *driver,
+                                    const PpdPstateGroup  *groups,
+                                    GPtrArray            **devices,
+                                    guint                  n_groups);
+void ppd_pstate_cpus_free (PpdPstateCpus *cpus);
+gboolean ppd_pstate_cpus_activate_profile (PpdPstateCpus  *cpus,
+                                           PpdProfile      profile,
+                                           GError        **error);
+void ppd_pstate_cpus_activate_profile_async (PpdPstateCpus       *cpus,
+                                             PpdProfile           profile,
+                                             GCancellable        *cancellable,
+                                             GAsyncReadyCallback  callback,
+                                             gpointer             user_data);
+gboolean ppd_pstate_cpus_activate_profile_finish (PpdPstateCpus  *cpus,
+                                                  GAsyncResult   *result,
+                                                  GError        **error);
+void ppd_pstate_cpus_rollback_profile (PpdPstateCpus *cpus,
+                                       PpdProfile     profile);
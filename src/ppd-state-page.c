@@ -0,0 +1,133 @@
+/*
+ * Copyright (c) 2020 Bastien Nocera <hadess@hadess.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#include "ppd-state-page.h"
+
+#include <gio/gio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* The daemon writes to a shared mapping of a memfd, sealed against any
+ * other writes where the kernel supports it, and hands out a read-only
+ * file descriptor for the same memory, so that clients can map it and
+ * read the state without asking the daemon. */
+struct _PpdStatePage {
+  PpdStateData *data;
+  gsize size;
+  int fd;
+};
+
+static void
+set_error_from_errno (GError     **error,
+                      int          errsv,
+                      const char  *what)
+{
+  g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+               "Could not %s state page: %s", what, g_strerror (errsv));
+}
+
+PpdStatePage *
+ppd_state_page_new (GError **error)
+{
+  g_autofree char *path = NULL;
+  PpdStatePage *page;
+  void *map;
+  int memfd;
+  int fd = -1;
+  gsize size;
+
+  memfd = memfd_create ("power-profiles-state", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (memfd < 0) {
+    set_error_from_errno (error, errno, "create");
+    return NULL;
+  }
+
+  size = MAX (sizeof (PpdStateData), (gsize) sysconf (_SC_PAGESIZE));
+  if (ftruncate (memfd, size) < 0) {
+    set_error_from_errno (error, errno, "size");
+    close (memfd);
+    return NULL;
+  }
+
+  map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+  if (map == MAP_FAILED) {
+    set_error_from_errno (error, errno, "map");
+    close (memfd);
+    return NULL;
+  }
+
+#ifdef F_SEAL_FUTURE_WRITE
+  /* A read-only descriptor can be reopened writable through /proc, so
+   * only the seal keeps clients from writing to the page. The daemon's
+   * existing mapping stays writable. It needs Linux 5.1 or newer. */
+  if (fcntl (memfd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE) < 0) {
+    if (errno != EINVAL) {
+      set_error_from_errno (error, errno, "seal");
+      munmap (map, size);
+      close (memfd);
+      return NULL;
+    }
+    g_debug ("Kernel can't seal the state page against writes");
+  }
+#endif
+
+  /* Clients can't resize the page from under the daemon either */
+  path = g_strdup_printf ("/proc/self/fd/%d", memfd);
+  if (fcntl (memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0 ||
+      (fd = open (path, O_RDONLY | O_CLOEXEC)) < 0) {
+    set_error_from_errno (error, errno, "seal");
+    munmap (map, size);
+    close (memfd);
+    return NULL;
+  }
+  close (memfd);
+
+  page = g_new0 (PpdStatePage, 1);
+  page->data = map;
+  page->size = size;
+  page->fd = fd;
+  page->data->version = PPD_STATE_PAGE_VERSION;
+
+  return page;
+}
+
+void
+ppd_state_page_free (PpdStatePage *page)
+{
+  if (page == NULL)
+    return;
+
+  munmap (page->data, page->size);
+  close (page->fd);
+  g_free (page);
+}
+
+/* Returns: (transfer none): a read-only file descriptor for the page */
+int
+ppd_state_page_get_fd (PpdStatePage *page)
+{
+  return page->fd;
+}
+
+/* Makes the sequence odd so that readers retry until the matching
+ * ppd_state_page_end_write() call. There is a single writer. */
+PpdStateData *
+ppd_state_page_begin_write (PpdStatePage *page)
+{
+  g_atomic_int_inc (&page->data->sequence);
+  return page->data;
+}
+
+void
+ppd_state_page_end_write (PpdStatePage *page)
+{
+  g_atomic_int_inc (&page->data->sequence);
+}
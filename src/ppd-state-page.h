@@ -0,0 +1,38 @@
+/*
+ * Copyright (c) 2020 Bastien Nocera <hadess@hadess.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <glib.h>
+
+#define PPD_STATE_PAGE_VERSION 1
+
+/* The layout of the state page, in native byte order. Readers must load
+ * "sequence", retry while it is odd, copy the fields they need, and retry
+ * if "sequence" changed in the meantime. Strings are NUL-terminated. */
+typedef struct {
+  gint    sequence;
+  guint32 version;
+  guint32 hold_count;
+  guint32 reserved;
+  guint64 transition_count;
+  char    active_profile[16];
+  char    selected_profile[16];
+  char    performance_degraded[128];
+} PpdStateData;
+
+typedef struct _PpdStatePage PpdStatePage;
+
+PpdStatePage *ppd_state_page_new (GError **error);
+void ppd_state_page_free (PpdStatePage *page);
+int ppd_state_page_get_fd (PpdStatePage *page);
+PpdStateData *ppd_state_page_begin_write (PpdStatePage *page);
+void ppd_state_page_end_write (PpdStatePage *page);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdStatePage, ppd_state_page_free)
@@ -0,0 +1,317 @@
+/*
+ * Copyright (c) 2020 Bastien Nocera <hadess@hadess.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#include "ppd-system-monitor.h"
+
+/**
+ * SECTION:ppd-system-monitor
+ * @Short_description: System Services Monitor
+ * @Title: System Services Monitor
+ *
+ * The system monitor connects to systemd-logind and UPower once, on behalf
+ * of the daemon and of all the drivers and actions, so that none of them
+ * need to block on those services to start, or to keep their own proxies.
+ *
+ * Drivers and actions can connect to the #PpdSystemMonitor::prepare-for-sleep
+ * signal to know about suspend and resume, and watch the
+ * #PpdSystemMonitor:on-battery and #PpdSystemMonitor:lid-closed properties.
+ */
+
+#define LOGIND_DBUS_NAME                        "org.freedesktop.login1"
+#define LOGIND_DBUS_PATH                        "/org/freedesktop/login1"
+#define LOGIND_DBUS_INTERFACE                   "org.freedesktop.login1.Manager"
+
+#define UPOWER_DBUS_NAME                        "org.freedesktop.UPower"
+#define UPOWER_DBUS_PATH                        "/org/freedesktop/UPower"
+#define UPOWER_DBUS_INTERFACE                   "org.freedesktop.UPower"
+
+struct _PpdSystemMonitor
+{
+  GObject       parent_instance;
+
+  GCancellable *cancellable;
+  GDBusProxy   *logind_proxy;
+  GDBusProxy   *upower_proxy;
+  gboolean      on_battery;
+  gboolean      lid_closed;
+};
+
+enum {
+  PROP_0,
+  PROP_ON_BATTERY,
+  PROP_LID_CLOSED
+};
+
+enum {
+  PREPARE_FOR_SLEEP,
+  LAST_SIGNAL
+};
+
+static guint signals[LAST_SIGNAL] = { 0 };
+
+G_DEFINE_TYPE (PpdSystemMonitor, ppd_system_monitor, G_TYPE_OBJECT)
+
+G_LOCK_DEFINE_STATIC (default_monitor);
+static PpdSystemMonitor *default_monitor = NULL;
+
+static void
+logind_signal_cb (GDBusProxy  *proxy,
+                  const char  *sender_name,
+                  const char  *signal_name,
+                  GVariant    *parameters,
+                  gpointer     user_data)
+{
+  PpdSystemMonitor *monitor = user_data;
+  gboolean start;
+
+  if (g_strcmp0 (signal_name, "PrepareForSleep") != 0)
+    return;
+  g_variant_get (parameters, "(b)", &start);
+  g_signal_emit (monitor, signals[PREPARE_FOR_SLEEP], 0, start);
+}
+
+static void
+logind_proxy_ready_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  PpdSystemMonitor *monitor;
+  GDBusProxy *proxy;
+
+  proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
+  if (proxy == NULL) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_debug ("Could not create proxy for logind: %s", error->message);
+    return;
+  }
+
+  monitor = user_data;
+  monitor->logind_proxy = proxy;
+  g_signal_connect (monitor->logind_proxy, "g-signal",
+                    G_CALLBACK (logind_signal_cb), monitor);
+}
+
+static gboolean
+get_cached_boolean (GDBusProxy *proxy,
+                    const char *property_name)
+{
+  g_autoptr(GVariant) value = NULL;
+
+  value = g_dbus_proxy_get_cached_property (proxy, property_name);
+  if (value == NULL || !g_variant_is_of_type (value, G_VARIANT_TYPE_BOOLEAN))
+    return FALSE;
+  return g_variant_get_boolean (value);
+}
+
+/* Also called when UPower restarts or goes away, as the proxy
+ * then reloads or drops its cached properties */
+static void
+update_power_state (PpdSystemMonitor *monitor)
+{
+  gboolean on_battery, lid_closed;
+
+  on_battery = get_cached_boolean (monitor->upower_proxy, "OnBattery");
+  lid_closed = get_cached_boolean (monitor->upower_proxy, "LidIsClosed");
+
+  if (on_battery != monitor->on_battery) {
+    monitor->on_battery = on_battery;
+    g_debug ("System is now on %s power", on_battery ? "battery" : "AC");
+    g_object_notify (G_OBJECT (monitor), "on-battery");
+  }
+  if (lid_closed != monitor->lid_closed) {
+    monitor->lid_closed = lid_closed;
+    g_debug ("Lid is now %s", lid_closed ? "closed" : "open");
+    g_object_notify (G_OBJECT (monitor), "lid-closed");
+  }
+}
+
+static void
+upower_properties_changed_cb (GDBusProxy *proxy,
+                              GVariant   *changed_properties,
+                              GStrv       invalidated_properties,
+                              gpointer    user_data)
+{
+  update_power_state (user_data);
+}
+
+static void
+upower_proxy_ready_cb (GObject      *source_object,
+                       GAsyncResult *res,
+                       gpointer      user_data)
+{
+  g_autoptr(GError) error = NULL;
+  PpdSystemMonitor *monitor;
+  GDBusProxy *proxy;
+
+  proxy = g_dbus_proxy_new_for_bus_finish (res, &error);
+  if (proxy == NULL) {
+    if (!g_error_matches (error, G_IO_ERROR, G_IO_ERROR_CANCELLED))
+      g_debug ("Could not create proxy for UPower: %s", error->message);
+    return;
+  }
+
+  monitor = user_data;
+  monitor->upower_proxy = proxy;
+  g_signal_connect (monitor->upower_proxy, "g-properties-changed",
+                    G_CALLBACK (upower_properties_changed_cb), monitor);
+  update_power_state (monitor);
+}
+
+/**
+ * ppd_system_monitor_get_default:
+ *
+ * Returns: (transfer full): the #PpdSystemMonitor shared by the daemon,
+ * creating it if needed. Proxies are created asynchronously in the
+ * thread-default main context of the first caller.
+ */
+PpdSystemMonitor *
+ppd_system_monitor_get_default (void)
+{
+  PpdSystemMonitor *monitor;
+
+  G_LOCK (default_monitor);
+  if (default_monitor == NULL)
+    default_monitor = g_object_new (PPD_TYPE_SYSTEM_MONITOR, NULL);
+  else
+    g_object_ref (default_monitor);
+  monitor = default_monitor;
+  G_UNLOCK (default_monitor);
+
+  return monitor;
+}
+
+gboolean
+ppd_system_monitor_get_on_battery (PpdSystemMonitor *monitor)
+{
+  g_return_val_if_fail (PPD_IS_SYSTEM_MONITOR (monitor), FALSE);
+
+  return monitor->on_battery;
+}
+
+gboolean
+ppd_system_monitor_get_lid_closed (PpdSystemMonitor *monitor)
+{
+  g_return_val_if_fail (PPD_IS_SYSTEM_MONITOR (monitor), FALSE);
+
+  return monitor->lid_closed;
+}
+
+static void
+ppd_system_monitor_get_property (GObject        *object,
+                                 guint           property_id,
+                                 GValue         *value,
+                                 GParamSpec     *pspec)
+{
+  PpdSystemMonitor *monitor = PPD_SYSTEM_MONITOR (object);
+
+  switch (property_id) {
+  case PROP_ON_BATTERY:
+    g_value_set_boolean (value, monitor->on_battery);
+    break;
+  case PROP_LID_CLOSED:
+    g_value_set_boolean (value, monitor->lid_closed);
+    break;
+  default:
+    G_OBJECT_WARN_INVALID_PROPERTY_ID (object, property_id, pspec);
+  }
+}
+
+static void
+ppd_system_monitor_finalize (GObject *object)
+{
+  PpdSystemMonitor *monitor = PPD_SYSTEM_MONITOR (object);
+
+  G_LOCK (default_monitor);
+  if (default_monitor == monitor)
+    default_monitor = NULL;
+  G_UNLOCK (default_monitor);
+
+  g_cancellable_cancel (monitor->cancellable);
+  g_clear_object (&monitor->cancellable);
+  g_clear_object (&monitor->logind_proxy);
+  g_clear_object (&monitor->upower_proxy);
+  G_OBJECT_CLASS (ppd_system_monitor_parent_class)->finalize (object);
+}
+
+static void
+ppd_system_monitor_class_init (PpdSystemMonitorClass *klass)
+{
+  GObjectClass *object_class;
+
+  object_class = G_OBJECT_CLASS(klass);
+  object_class->get_property = ppd_system_monitor_get_property;
+  object_class->finalize = ppd_system_monitor_finalize;
+
+  /**
+   * PpdSystemMonitor::prepare-for-sleep:
+   * @start: %TRUE before suspending, %FALSE after resuming
+   *
+   * Relays logind's PrepareForSleep signal.
+   */
+  signals[PREPARE_FOR_SLEEP] = g_signal_new ("prepare-for-sleep",
+                                             G_TYPE_FROM_CLASS (klass),
+                                             G_SIGNAL_RUN_LAST,
+                                             0,
+                                             NULL,
+                                             NULL,
+                                             g_cclosure_marshal_VOID__BOOLEAN,
+                                             G_TYPE_NONE,
+                                             1,
+                                             G_TYPE_BOOLEAN);
+
+  /**
+   * PpdSystemMonitor:on-battery:
+   *
+   * Whether UPower reports the system as running on battery.
+   */
+  g_object_class_install_property (object_class, PROP_ON_BATTERY,
+                                   g_param_spec_boolean ("on-battery",
+                                                         "On battery",
+                                                         "Whether the system is running on battery",
+                                                         FALSE,
+                                                         G_PARAM_READABLE));
+
+  /**
+   * PpdSystemMonitor:lid-closed:
+   *
+   * Whether UPower reports the laptop lid as closed.
+   */
+  g_object_class_install_property (object_class, PROP_LID_CLOSED,
+                                   g_param_spec_boolean ("lid-closed",
+                                                         "Lid closed",
+                                                         "Whether the laptop lid is closed",
+                                                         FALSE,
+                                                         G_PARAM_READABLE));
+}
+
+static void
+ppd_system_monitor_init (PpdSystemMonitor *self)
+{
+  self->cancellable = g_cancellable_new ();
+
+  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SYSTEM,
+                            G_DBUS_PROXY_FLAGS_DO_NOT_LOAD_PROPERTIES,
+                            NULL,
+                            LOGIND_DBUS_NAME,
+                            LOGIND_DBUS_PATH,
+                            LOGIND_DBUS_INTERFACE,
+                            self->cancellable,
+                            logind_proxy_ready_cb,
+                            self);
+  g_dbus_proxy_new_for_bus (G_BUS_TYPE_SYSTEM,
+                            G_DBUS_PROXY_FLAGS_DO_NOT_AUTO_START,
+                            NULL,
+                            UPOWER_DBUS_NAME,
+                            UPOWER_DBUS_PATH,
+                            UPOWER_DBUS_INTERFACE,
+                            self->cancellable,
+                            upower_proxy_ready_cb,
+                            self);
+}
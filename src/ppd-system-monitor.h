@@ -0,0 +1,19 @@
+/*
+ * Copyright (c) 2020 Bastien Nocera <hadess@hadess.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License version 3 as published by
+ * the Free Software Foundation.
+ *
+ */
+
+#pragma once
+
+#include <gio/gio.h>
+
+#define PPD_TYPE_SYSTEM_MONITOR (ppd_system_monitor_get_type())
+G_DECLARE_FINAL_TYPE(PpdSystemMonitor, ppd_system_monitor, PPD, SYSTEM_MONITOR, GObject)
+
+PpdSystemMonitor *ppd_system_monitor_get_default (void);
+gboolean ppd_system_monitor_get_on_battery (PpdSystemMonitor *monitor);
+gboolean ppd_system_monitor_get_lid_closed (PpdSystemMonitor *monitor);
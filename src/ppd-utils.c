@@ -7,10 +7,176 @@
  *
  */
 
+#include "config.h"
+
 #include "ppd-utils.h"
 #include <gio/gio.h>
 #include <stdio.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#if HAVE_IO_URING
+#include <liburing.h>
+#endif
+
+typedef struct {
+  gatomicrefcount ref_count;
+  GMutex lock; /* protects everything below */
+  char *filename;
+  int fd;
+  gboolean needs_truncate;
+  gboolean readable;
+  char *shadow; /* last value written or read, NULL if unknown */
+  guint users; /* opens not closed yet, protected by the sysfs_handles lock */
+} SysfsHandle;
+
+/* Hashtable of filename to SysfsHandle, the lock protects the
+ * hashtable itself, as writes can happen from worker threads, and
+ * the handles are refcounted so they can outlive their removal */
+static GHashTable *sysfs_handles = NULL;
+G_LOCK_DEFINE_STATIC (sysfs_handles);
+
+/* Below this number of files, writing serially is cheaper
+ * than handing the writes over to worker threads */
+#define PARALLEL_WRITE_MIN_FILES 8
+#define PARALLEL_WRITE_MAX_THREADS 32
+
+static GThreadPool *write_pool = NULL;
+
+typedef struct {
+  const char *filename;
+  const char *value;
+} WritePlanEntry;
+
+typedef struct {
+  PpdWritePlanValueFunc value_func;
+  guint n_entries;
+} WritePlanGroupInfo;
+
+#define N_PLAN_PROFILES 3
+
+/* A single allocation: this header, then the groups, the entries for
+ * each profile, and the NUL-terminated filenames and values the entries
+ * point to. Plans are immutable, and refcounted so that worker threads
+ * can keep applying one after it was replaced. */
+struct _PpdWritePlan {
+  gatomicrefcount ref_count;
+  guint n_entries;
+  guint n_groups;
+  WritePlanGroupInfo *groups;
+  WritePlanEntry *entries[N_PLAN_PROFILES];
+};
+
+typedef struct {
+  GMutex mutex;
+  GCond cond;
+  guint pending;
+  guint n_failed;
+  GError *error;
+} WriteBatch;
+
+typedef struct {
+  WriteBatch *batch;
+  PpdWriteContext *context;
+  const WritePlanEntry *entries;
+  guint n_entries;
+} WriteChunk;
+
+typedef struct {
+  SysfsHandle *handle;
+  char *value;
+  const char *owner;
+  gboolean completed; /* by io_uring */
+} PendingWrite;
+
+typedef struct {
+  char *filename;
+  char *previous; /* NULL if it could not be read */
+} JournalEntry;
+
+/* The writes of a single profile transition: those to cached handles,
+ * queued until ppd_utils_write_batch_commit(), and the prior values of
+ * the attributes changed, in the order they were written. The lock
+ * protects it against writes from worker threads. */
+struct _PpdWriteContext {
+  gatomicrefcount ref_count;
+  GMutex lock;
+  GArray *pending_writes; /* NULL without io_uring, or once committed */
+  const char *owner;
+  GArray *journal; /* NULL once committed or rolled back */
+};
+
+/* The context that ppd_utils_write() calls from this thread belong to,
+ * %NULL outside of transitions so that those write straight away */
+static GPrivate current_write_context = G_PRIVATE_INIT (NULL);
+
+/* Probe results from previous runs, only valid on the same hardware */
+static GKeyFile *probe_cache = NULL;
+static char *probe_cache_path = NULL;
+static gboolean probe_cache_dirty = FALSE;
+G_LOCK_DEFINE_STATIC (probe_cache);
+
+/* Hashtable of owner to hashtable of operation to PpdLatencyStats,
+ * updated from whichever thread did the work */
+static GHashTable *latency_stats = NULL;
+G_LOCK_DEFINE_STATIC (latency_stats);
+
+#define PROBE_CACHE_GROUP "Cache"
+#define PROBE_CACHE_FINGERPRINT_KEY "Fingerprint"
+
+#if HAVE_IO_URING
+#define WRITE_RING_ENTRIES 256
+
+/* A single ring shared by every write context, the lock serialises
+ * its setup and the batches submitted to it */
+static struct io_uring write_ring;
+static gboolean write_ring_ready = FALSE;
+static gboolean write_ring_failed = FALSE;
+G_LOCK_DEFINE_STATIC (write_ring);
+#endif
+
+static SysfsHandle *
+sysfs_handle_ref (SysfsHandle *handle)
+{
+  g_atomic_ref_count_inc (&handle->ref_count);
+  return handle;
+}
+
+static void
+sysfs_handle_unref (SysfsHandle *handle)
+{
+  if (handle == NULL)
+    return;
+  if (!g_atomic_ref_count_dec (&handle->ref_count))
+    return;
+  if (handle->fd >= 0)
+    close (handle->fd);
+  g_mutex_clear (&handle->lock);
+  g_free (handle->filename);
+  g_free (handle->shadow);
+  g_free (handle);
+}
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (SysfsHandle, sysfs_handle_unref)
+
+static SysfsHandle *
+lookup_sysfs_handle (const char *filename)
+{
+  SysfsHandle *handle = NULL;
+
+  G_LOCK (sysfs_handles);
+  if (sysfs_handles != NULL)
+    handle = g_hash_table_lookup (sysfs_handles, filename);
+  if (handle != NULL)
+    sysfs_handle_ref (handle);
+  G_UNLOCK (sysfs_handles);
+
+  return handle;
+}
 
 char *
 ppd_utils_get_sysfs_path (const char *filename)
@@ -24,18 +190,412 @@ ppd_utils_get_sysfs_path (const char *filename)
   return g_build_filename (root, filename, NULL);
 }
 
+static int
+open_sysfs_attr (const char  *filename,
+                 gboolean    *needs_truncate,
+                 gboolean    *readable,
+                 GError     **error)
+{
+  struct statfs buf;
+  int fd;
+
+  /* Readable so that the shadow value can be refreshed */
+  fd = open (filename, O_RDWR | O_CLOEXEC);
+  *readable = (fd >= 0);
+  if (fd < 0)
+    fd = open (filename, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) {
+    int errsv = errno;
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                 "Could not open '%s' for writing", filename);
+    return -1;
+  }
+
+  /* sysfs attributes ignore the offset and size of the file, but
+   * regular files, such as the ones in umockdev testbeds, don't */
+  *needs_truncate = (fstatfs (fd, &buf) < 0 || buf.f_type != SYSFS_MAGIC);
+  return fd;
+}
+
+static void
+read_sysfs_handle (SysfsHandle *handle)
+{
+  char buf[4096];
+  ssize_t ret;
+
+  g_clear_pointer (&handle->shadow, g_free);
+  if (!handle->readable || handle->fd < 0)
+    return;
+
+  ret = pread (handle->fd, buf, sizeof (buf) - 1, 0);
+  if (ret < 0) {
+    g_debug ("Could not read '%s': %s", handle->filename, g_strerror (errno));
+    return;
+  }
+  buf[ret] = '\0';
+  handle->shadow = g_strchomp (g_strdup (buf));
+}
+
+static void
+journal_entry_clear (JournalEntry *entry)
+{
+  g_free (entry->filename);
+  g_free (entry->previous);
+}
+
+static gboolean
+write_context_is_batching (PpdWriteContext *context)
+{
+  gboolean ret;
+
+  if (context == NULL)
+    return FALSE;
+
+  g_mutex_lock (&context->lock);
+  ret = (context->pending_writes != NULL);
+  g_mutex_unlock (&context->lock);
+  return ret;
+}
+
+static const char *
+write_context_get_owner (PpdWriteContext *context)
+{
+  const char *owner;
+
+  if (context == NULL)
+    return NULL;
+
+  g_mutex_lock (&context->lock);
+  owner = context->owner;
+  g_mutex_unlock (&context->lock);
+  return owner;
+}
+
+static void
+journal_record (PpdWriteContext *context,
+                const char      *filename,
+                char            *previous)
+{
+  JournalEntry entry;
+
+  if (context == NULL) {
+    g_free (previous);
+    return;
+  }
+
+  g_mutex_lock (&context->lock);
+  if (context->journal == NULL) {
+    g_mutex_unlock (&context->lock);
+    g_free (previous);
+    return;
+  }
+  entry.filename = g_strdup (filename);
+  entry.previous = previous;
+  g_array_append_val (context->journal, entry);
+  g_mutex_unlock (&context->lock);
+}
+
+static char *
+read_uncached_value (const char *filename)
+{
+  char *contents = NULL;
+
+  if (!g_file_get_contents (filename, &contents, NULL, NULL))
+    return NULL;
+  return g_strchomp (contents);
+}
+
+static gboolean
+handle_matches_prefix (const char *filename,
+                       const char *prefix)
+{
+  size_t len;
+
+  if (prefix == NULL)
+    return TRUE;
+
+  len = strlen (prefix);
+  if (strncmp (filename, prefix, len) != 0)
+    return FALSE;
+  return (len > 0 && prefix[len - 1] == '/') ||
+         filename[len] == '\0' ||
+         filename[len] == '/';
+}
+
+/* Drops @handle from the cache if it is still the cached one for its
+ * attribute, so that the next write opens it again. The handle's lock
+ * must not be held, as the cache is locked before handles. */
+static void
+evict_sysfs_handle (SysfsHandle *handle)
+{
+  G_LOCK (sysfs_handles);
+  if (sysfs_handles != NULL &&
+      g_hash_table_lookup (sysfs_handles, handle->filename) == handle) {
+    g_debug ("Dropping cached handle for '%s'", handle->filename);
+    g_hash_table_remove (sysfs_handles, handle->filename);
+  }
+  G_UNLOCK (sysfs_handles);
+}
+
+static gboolean
+write_sysfs_handle (PpdWriteContext  *context,
+                    SysfsHandle      *handle,
+                    const char       *value,
+                    GError          **error)
+{
+  g_autofree char *previous = NULL;
+  size_t len = strlen (value);
+  ssize_t ret;
+  int errsv;
+
+  /* Whatever happens, the previous value isn't known to be valid anymore */
+  previous = g_steal_pointer (&handle->shadow);
+
+  ret = handle->fd >= 0 ? pwrite (handle->fd, value, len, 0) : -1;
+  if (ret < 0 && (handle->fd < 0 || errno == ENODEV || errno == ENOENT)) {
+    /* The attribute went away under us, eg. the CPU was unplugged,
+     * so try to reopen it, or let the caller drop the handle otherwise */
+    g_debug ("Cached handle for '%s' is stale, reopening", handle->filename);
+    if (handle->fd >= 0)
+      close (handle->fd);
+    handle->fd = open_sysfs_attr (handle->filename, &handle->needs_truncate, &handle->readable, error);
+    if (handle->fd < 0)
+      return FALSE;
+    ret = pwrite (handle->fd, value, len, 0);
+  }
+  if (ret < 0) {
+    errsv = errno;
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                 "Error writing '%s': %s", handle->filename, g_strerror (errsv));
+    g_debug ("Error writing '%s': %s", handle->filename, g_strerror (errsv));
+    return FALSE;
+  }
+  if ((size_t) ret < len) {
+    g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Short write to '%s': %zd of %zu bytes", handle->filename, ret, len);
+    return FALSE;
+  }
+  if (handle->needs_truncate && ftruncate (handle->fd, len) < 0) {
+    errsv = errno;
+    g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                 "Error truncating '%s': %s", handle->filename, g_strerror (errsv));
+    return FALSE;
+  }
+  handle->shadow = g_strdup (value);
+  journal_record (context, handle->filename, g_steal_pointer (&previous));
+  return TRUE;
+}
+
+/* Keeps @filename open so that ppd_utils_write() calls for it become
+ * a single pwrite(). Drivers should call this when probing, and
+ * ppd_utils_sysfs_cache_close() once they don't need it anymore. */
+gboolean
+ppd_utils_sysfs_cache_open (const char  *filename,
+                            GError     **error)
+{
+  SysfsHandle *handle;
+  gboolean needs_truncate, readable;
+  int fd;
+
+  g_return_val_if_fail (filename, FALSE);
+
+  G_LOCK (sysfs_handles);
+  if (sysfs_handles == NULL) {
+    sysfs_handles = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           NULL, (GDestroyNotify) sysfs_handle_unref);
+  }
+  handle = g_hash_table_lookup (sysfs_handles, filename);
+  if (handle != NULL) {
+    /* Another driver instance opened it, and its idea of the
+     * current value might not be valid anymore */
+    handle->users++;
+    g_mutex_lock (&handle->lock);
+    read_sysfs_handle (handle);
+    g_mutex_unlock (&handle->lock);
+    G_UNLOCK (sysfs_handles);
+    return TRUE;
+  }
+
+  fd = open_sysfs_attr (filename, &needs_truncate, &readable, error);
+  if (fd < 0) {
+    G_UNLOCK (sysfs_handles);
+    return FALSE;
+  }
+
+  handle = g_new0 (SysfsHandle, 1);
+  g_atomic_ref_count_init (&handle->ref_count);
+  g_mutex_init (&handle->lock);
+  handle->filename = g_strdup (filename);
+  handle->fd = fd;
+  handle->needs_truncate = needs_truncate;
+  handle->readable = readable;
+  handle->users = 1;
+  read_sysfs_handle (handle);
+  g_hash_table_insert (sysfs_handles, handle->filename, handle);
+  G_UNLOCK (sysfs_handles);
+
+  return TRUE;
+}
+
+/* Undoes a ppd_utils_sysfs_cache_open() call, closing the handle
+ * once every driver that opened it is done with it. */
+void
+ppd_utils_sysfs_cache_close (const char *filename)
+{
+  SysfsHandle *handle;
+
+  G_LOCK (sysfs_handles);
+  if (sysfs_handles == NULL)
+    goto out;
+
+  handle = g_hash_table_lookup (sysfs_handles, filename);
+  if (handle != NULL && --handle->users == 0) {
+    g_debug ("Closing cached handle for '%s'", filename);
+    g_hash_table_remove (sysfs_handles, filename);
+  }
+
+out:
+  G_UNLOCK (sysfs_handles);
+}
+
+/* Closes the cached handles for @prefix, or for the attributes below it
+ * if it is a device directory. All the handles are closed if %NULL,
+ * whether drivers still use them or not. */
+void
+ppd_utils_sysfs_cache_invalidate (const char *prefix)
+{
+  GHashTableIter iter;
+  gpointer key;
+
+  G_LOCK (sysfs_handles);
+  if (sysfs_handles == NULL)
+    goto out;
+
+  if (prefix == NULL) {
+    g_hash_table_remove_all (sysfs_handles);
+    goto out;
+  }
+
+  g_hash_table_iter_init (&iter, sysfs_handles);
+  while (g_hash_table_iter_next (&iter, &key, NULL)) {
+    const char *filename = key;
+
+    if (!handle_matches_prefix (filename, prefix))
+      continue;
+
+    g_debug ("Closing cached handle for '%s'", filename);
+    g_hash_table_iter_remove (&iter);
+  }
+
+out:
+  G_UNLOCK (sysfs_handles);
+}
+
+/* Verify mode: reads back the cached attributes matching @prefix, all
+ * of them if %NULL, to refresh their shadow values after something else,
+ * such as the firmware on resume, could have changed them. */
+void
+ppd_utils_sysfs_cache_verify (const char *prefix)
+{
+  GHashTableIter iter;
+  gpointer key, value;
+
+  G_LOCK (sysfs_handles);
+  if (sysfs_handles == NULL)
+    goto out;
+
+  g_hash_table_iter_init (&iter, sysfs_handles);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    SysfsHandle *handle = value;
+
+    if (!handle_matches_prefix (key, prefix))
+      continue;
+
+    g_mutex_lock (&handle->lock);
+    read_sysfs_handle (handle);
+    g_debug ("Verified '%s' is '%s'", handle->filename,
+             handle->shadow ? handle->shadow : "(unknown)");
+    g_mutex_unlock (&handle->lock);
+  }
+
+out:
+  G_UNLOCK (sysfs_handles);
+}
+
 gboolean ppd_utils_write (const char  *filename,
                           const char  *value,
                           GError     **error)
 {
+  g_autoptr(SysfsHandle) handle = NULL;
+  g_autofree char *previous = NULL;
+  PpdWriteContext *context;
+  const char *owner;
+  gint64 start;
   FILE *sysfsfp;
   int ret;
 
   g_return_val_if_fail (filename, FALSE);
   g_return_val_if_fail (value, FALSE);
 
+  handle = lookup_sysfs_handle (filename);
+  context = g_private_get (&current_write_context);
+
+  if (handle != NULL) {
+    gboolean queued = FALSE;
+    gboolean stale;
+
+    g_mutex_lock (&handle->lock);
+
+    /* The prior value needs to be known before it gets overwritten
+     * for the transaction to be able to restore it */
+    if (context != NULL && handle->shadow == NULL)
+      read_sysfs_handle (handle);
+
+    if (g_strcmp0 (handle->shadow, value) == 0) {
+      g_mutex_unlock (&handle->lock);
+      g_debug ("Not writing '%s' to '%s', already set", value, filename);
+      return TRUE;
+    }
+    g_debug ("Writing '%s' to '%s'", value, filename);
+
+    owner = NULL;
+    if (context != NULL) {
+      g_mutex_lock (&context->lock);
+      owner = context->owner;
+      if (context->pending_writes != NULL) {
+        PendingWrite write;
+
+        write.handle = sysfs_handle_ref (handle);
+        write.value = g_strdup (value);
+        write.owner = context->owner;
+        write.completed = FALSE;
+        g_array_append_val (context->pending_writes, write);
+        queued = TRUE;
+      }
+      g_mutex_unlock (&context->lock);
+    }
+
+    if (queued) {
+      g_mutex_unlock (&handle->lock);
+      return TRUE;
+    }
+    start = g_get_monotonic_time ();
+    ret = write_sysfs_handle (context, handle, value, error);
+    ppd_utils_latency_record (owner, PPD_LATENCY_WRITE, g_get_monotonic_time () - start);
+    stale = (handle->fd < 0);
+    g_mutex_unlock (&handle->lock);
+    if (stale)
+      evict_sysfs_handle (handle);
+    return ret;
+  }
+
   g_debug ("Writing '%s' to '%s'", value, filename);
 
+  if (context != NULL)
+    previous = read_uncached_value (filename);
+  owner = write_context_get_owner (context);
+
+  start = g_get_monotonic_time ();
   sysfsfp = fopen (filename, "w");
   if (sysfsfp == NULL) {
     g_set_error (error, G_IO_ERROR, g_io_error_from_errno (errno),
@@ -57,9 +617,806 @@ gboolean ppd_utils_write (const char  *filename,
     g_debug ("Error closing '%s': %s", filename, g_strerror (errno));
     return FALSE;
   }
+  ppd_utils_latency_record (owner, PPD_LATENCY_WRITE, g_get_monotonic_time () - start);
+  journal_record (context, filename, g_steal_pointer (&previous));
   return TRUE;
 }
 
+static void
+write_chunk_func (gpointer data,
+                  gpointer user_data)
+{
+  WriteChunk *chunk = data;
+  WriteBatch *batch = chunk->batch;
+  GError *first_error = NULL;
+  guint n_failed = 0;
+  guint i;
+
+  /* The writes belong to the same transition as the caller's */
+  g_private_set (&current_write_context, chunk->context);
+  for (i = 0; i < chunk->n_entries; i++) {
+    g_autoptr(GError) error = NULL;
+
+    if (ppd_utils_write (chunk->entries[i].filename, chunk->entries[i].value, &error))
+      continue;
+    n_failed++;
+    if (first_error == NULL)
+      first_error = g_steal_pointer (&error);
+  }
+  g_private_set (&current_write_context, NULL);
+
+  g_mutex_lock (&batch->mutex);
+  batch->n_failed += n_failed;
+  if (batch->error == NULL)
+    batch->error = g_steal_pointer (&first_error);
+  batch->pending--;
+  g_cond_signal (&batch->cond);
+  g_mutex_unlock (&batch->mutex);
+
+  g_clear_error (&first_error);
+}
+
+static GThreadPool *
+get_write_pool (void)
+{
+  if (write_pool == NULL) {
+    guint n_threads;
+
+    n_threads = MIN (g_get_num_processors (), PARALLEL_WRITE_MAX_THREADS);
+    write_pool = g_thread_pool_new (write_chunk_func, NULL, n_threads, FALSE, NULL);
+  }
+  return write_pool;
+}
+
+static guint
+plan_profile_index (PpdProfile profile)
+{
+  g_assert (ppd_profile_has_single_flag (profile));
+  return g_bit_nth_lsf (profile, -1);
+}
+
+/* Compiles the writes needed to switch each group of files to any
+ * profile into a single allocation, so that applying a profile does
+ * not need to allocate, or to build any strings. */
+PpdWritePlan *
+ppd_utils_write_plan_new (const PpdWritePlanGroup *groups,
+                          guint                    n_groups)
+{
+  PpdWritePlan *plan;
+  gsize strings_size = 0;
+  guint n_entries = 0;
+  char *strings;
+  guint i, j, p;
+
+  for (i = 0; i < n_groups; i++) {
+    n_entries += groups[i].filenames->len;
+    for (j = 0; j < groups[i].filenames->len; j++)
+      strings_size += strlen (g_ptr_array_index (groups[i].filenames, j)) + 1;
+    for (p = 0; p < N_PLAN_PROFILES; p++)
+      strings_size += strlen (groups[i].value_func (1 << p)) + 1;
+  }
+
+  plan = g_malloc (sizeof (PpdWritePlan) +
+                   n_groups * sizeof (WritePlanGroupInfo) +
+                   N_PLAN_PROFILES * n_entries * sizeof (WritePlanEntry) +
+                   strings_size);
+  g_atomic_ref_count_init (&plan->ref_count);
+  plan->n_entries = n_entries;
+  plan->n_groups = n_groups;
+  plan->groups = (WritePlanGroupInfo *) (plan + 1);
+  for (p = 0; p < N_PLAN_PROFILES; p++)
+    plan->entries[p] = (WritePlanEntry *) (plan->groups + n_groups) + p * n_entries;
+  strings = (char *) (plan->entries[0] + N_PLAN_PROFILES * n_entries);
+
+  n_entries = 0;
+  for (i = 0; i < n_groups; i++) {
+    const char *values[N_PLAN_PROFILES];
+
+    plan->groups[i].value_func = groups[i].value_func;
+    plan->groups[i].n_entries = groups[i].filenames->len;
+
+    /* Each value is stored once per group, and shared by its files */
+    for (p = 0; p < N_PLAN_PROFILES; p++) {
+      values[p] = strings;
+      strings = g_stpcpy (strings, groups[i].value_func (1 << p)) + 1;
+    }
+
+    for (j = 0; j < groups[i].filenames->len; j++, n_entries++) {
+      const char *filename = strings;
+
+      strings = g_stpcpy (strings, g_ptr_array_index (groups[i].filenames, j)) + 1;
+      for (p = 0; p < N_PLAN_PROFILES; p++) {
+        plan->entries[p][n_entries].filename = filename;
+        plan->entries[p][n_entries].value = values[p];
+      }
+    }
+  }
+
+  return plan;
+}
+
+PpdWritePlan *
+ppd_utils_write_plan_ref (PpdWritePlan *plan)
+{
+  g_atomic_ref_count_inc (&plan->ref_count);
+  return plan;
+}
+
+void
+ppd_utils_write_plan_unref (PpdWritePlan *plan)
+{
+  if (plan == NULL)
+    return;
+  if (g_atomic_ref_count_dec (&plan->ref_count))
+    g_free (plan);
+}
+
+gboolean
+ppd_utils_write_plan_contains (const PpdWritePlan *plan,
+                               const char         *filename)
+{
+  guint i;
+
+  for (i = 0; i < plan->n_entries; i++) {
+    if (g_str_equal (plan->entries[0][i].filename, filename))
+      return TRUE;
+  }
+  return FALSE;
+}
+
+/* Closes the cached handles of the attributes @plan writes to */
+void
+ppd_utils_write_plan_close_handles (const PpdWritePlan *plan)
+{
+  guint i;
+
+  for (i = 0; i < plan->n_entries; i++)
+    ppd_utils_sysfs_cache_close (plan->entries[0][i].filename);
+}
+
+/* Compiles a copy of @plan with @add_filename appended to @add_group,
+ * and without @remove_filename, either of which can be %NULL */
+static PpdWritePlan *
+write_plan_rebuild (const PpdWritePlan *plan,
+                    guint               add_group,
+                    const char         *add_filename,
+                    const char         *remove_filename)
+{
+  g_autofree PpdWritePlanGroup *groups = NULL;
+  PpdWritePlan *new_plan;
+  guint i, j, n_entries = 0;
+
+  groups = g_new0 (PpdWritePlanGroup, plan->n_groups);
+  for (i = 0; i < plan->n_groups; i++) {
+    groups[i].value_func = plan->groups[i].value_func;
+    groups[i].filenames = g_ptr_array_new ();
+    for (j = 0; j < plan->groups[i].n_entries; j++, n_entries++) {
+      const char *filename = plan->entries[0][n_entries].filename;
+
+      if (g_strcmp0 (filename, remove_filename) != 0)
+        g_ptr_array_add (groups[i].filenames, (gpointer) filename);
+    }
+    if (i == add_group && add_filename != NULL)
+      g_ptr_array_add (groups[i].filenames, (gpointer) add_filename);
+  }
+
+  new_plan = ppd_utils_write_plan_new (groups, plan->n_groups);
+
+  for (i = 0; i < plan->n_groups; i++)
+    g_ptr_array_unref (groups[i].filenames);
+
+  return new_plan;
+}
+
+/* Returns a new plan that also writes to @filename, using the values
+ * of group number @group, for devices that appeared after probing. */
+PpdWritePlan *
+ppd_utils_write_plan_add (const PpdWritePlan *plan,
+                          guint               group,
+                          const char         *filename)
+{
+  g_return_val_if_fail (plan != NULL, NULL);
+  g_return_val_if_fail (group < plan->n_groups, NULL);
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  return write_plan_rebuild (plan, group, filename, NULL);
+}
+
+/* Returns a new plan that doesn't write to @filename anymore */
+PpdWritePlan *
+ppd_utils_write_plan_remove (const PpdWritePlan *plan,
+                             const char         *filename)
+{
+  g_return_val_if_fail (plan != NULL, NULL);
+  g_return_val_if_fail (filename != NULL, NULL);
+
+  return write_plan_rebuild (plan, G_MAXUINT, NULL, filename);
+}
+
+/* Runs the writes of @plan for @profile, splitting them across worker
+ * threads if there are enough of them. All the writes are attempted,
+ * and the first error is returned if any failed. */
+gboolean
+ppd_utils_write_plan_apply (const PpdWritePlan  *plan,
+                            PpdProfile           profile,
+                            GError             **error)
+{
+  WriteChunk chunks[PARALLEL_WRITE_MAX_THREADS];
+  const WritePlanEntry *entries;
+  PpdWriteContext *context;
+  WriteBatch batch = { 0 };
+  guint n_chunks, chunk_size;
+  guint i;
+
+  g_return_val_if_fail (plan != NULL, FALSE);
+
+  entries = plan->entries[plan_profile_index (profile)];
+  context = g_private_get (&current_write_context);
+
+  /* Batched writes are only queued, no need for threads */
+  if (plan->n_entries < PARALLEL_WRITE_MIN_FILES ||
+      write_context_is_batching (context)) {
+    for (i = 0; i < plan->n_entries; i++) {
+      if (!ppd_utils_write (entries[i].filename, entries[i].value, error))
+        return FALSE;
+    }
+    return TRUE;
+  }
+
+  n_chunks = MIN (g_get_num_processors (), PARALLEL_WRITE_MAX_THREADS);
+  n_chunks = CLAMP (n_chunks, 1, plan->n_entries);
+  chunk_size = (plan->n_entries + n_chunks - 1) / n_chunks;
+
+  g_mutex_init (&batch.mutex);
+  g_cond_init (&batch.cond);
+
+  g_mutex_lock (&batch.mutex);
+  for (i = 0; i * chunk_size < plan->n_entries; i++) {
+    WriteChunk *chunk = &chunks[i];
+
+    chunk->batch = &batch;
+    chunk->context = context;
+    chunk->entries = entries + i * chunk_size;
+    chunk->n_entries = MIN (chunk_size, plan->n_entries - i * chunk_size);
+    batch.pending++;
+    g_thread_pool_push (get_write_pool (), chunk, NULL);
+  }
+  while (batch.pending > 0)
+    g_cond_wait (&batch.cond, &batch.mutex);
+  g_mutex_unlock (&batch.mutex);
+
+  g_mutex_clear (&batch.mutex);
+  g_cond_clear (&batch.cond);
+
+  if (batch.error != NULL) {
+    if (batch.n_failed > 1)
+      g_prefix_error (&batch.error, "%u of %u writes failed: ", batch.n_failed, plan->n_entries);
+    g_propagate_error (error, batch.error);
+    return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+pending_write_clear (PendingWrite *write)
+{
+  sysfs_handle_unref (write->handle);
+  g_free (write->value);
+}
+
+static void
+record_batch_error (GHashTable   *errors,
+                    PendingWrite *write,
+                    GError       *error)
+{
+  const char *owner = write->owner ? write->owner : "";
+
+  g_debug ("Batched write of '%s' to '%s' failed: %s",
+           write->value, write->handle->filename, error->message);
+  if (g_hash_table_contains (errors, owner)) {
+    g_error_free (error);
+    return;
+  }
+  g_hash_table_insert (errors, (gpointer) owner, error);
+}
+
+static void
+write_pending (PpdWriteContext *context,
+               GHashTable      *errors,
+               PendingWrite    *write)
+{
+  GError *error = NULL;
+  gboolean stale;
+  gint64 start;
+
+  g_mutex_lock (&write->handle->lock);
+  start = g_get_monotonic_time ();
+  if (!write_sysfs_handle (context, write->handle, write->value, &error))
+    record_batch_error (errors, write, error);
+  ppd_utils_latency_record (write->owner, PPD_LATENCY_WRITE, g_get_monotonic_time () - start);
+  stale = (write->handle->fd < 0);
+  g_mutex_unlock (&write->handle->lock);
+  if (stale)
+    evict_sysfs_handle (write->handle);
+}
+
+#if HAVE_IO_URING
+static void
+complete_batch_write (PpdWriteContext *context,
+                      GHashTable      *errors,
+                      PendingWrite    *write,
+                      int              res)
+{
+  SysfsHandle *handle = write->handle;
+  g_autofree char *previous = NULL;
+  GError *error = NULL;
+
+  if (res == -ENODEV || res == -ENOENT || res == -EBADF) {
+    /* Let the synchronous path reopen stale handles */
+    write_pending (context, errors, write);
+    return;
+  }
+
+  g_mutex_lock (&handle->lock);
+  previous = g_steal_pointer (&handle->shadow);
+  if (res < 0) {
+    g_set_error (&error, G_IO_ERROR, g_io_error_from_errno (-res),
+                 "Error writing '%s': %s", handle->filename, g_strerror (-res));
+  } else if ((size_t) res < strlen (write->value)) {
+    g_set_error (&error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                 "Short write to '%s': %d of %zu bytes",
+                 handle->filename, res, strlen (write->value));
+  } else if (handle->needs_truncate &&
+             ftruncate (handle->fd, strlen (write->value)) < 0) {
+    int errsv = errno;
+    g_set_error (&error, G_IO_ERROR, g_io_error_from_errno (errsv),
+                 "Error truncating '%s': %s", handle->filename, g_strerror (errsv));
+  } else {
+    handle->shadow = g_strdup (write->value);
+    journal_record (context, handle->filename, g_steal_pointer (&previous));
+  }
+  g_mutex_unlock (&handle->lock);
+
+  if (error != NULL)
+    record_batch_error (errors, write, error);
+}
+
+static gboolean
+setup_write_ring (void)
+{
+  int ret;
+
+  if (write_ring_ready)
+    return TRUE;
+  if (write_ring_failed)
+    return FALSE;
+
+  ret = io_uring_queue_init (WRITE_RING_ENTRIES, &write_ring, 0);
+  if (ret < 0) {
+    g_debug ("Could not set up io_uring, falling back to synchronous writes: %s",
+             g_strerror (-ret));
+    write_ring_failed = TRUE;
+    return FALSE;
+  }
+  write_ring_ready = TRUE;
+  return TRUE;
+}
+
+/* Gives up on io_uring, and runs the writes from @first on that
+ * have no completion synchronously instead */
+static void
+abandon_write_ring (PpdWriteContext *context,
+                    GArray          *writes,
+                    guint            first,
+                    GHashTable      *errors)
+{
+  guint i;
+
+  io_uring_queue_exit (&write_ring);
+  write_ring_ready = FALSE;
+  write_ring_failed = TRUE;
+
+  for (i = first; i < writes->len; i++) {
+    PendingWrite *write = &g_array_index (writes, PendingWrite, i);
+
+    if (!write->completed)
+      write_pending (context, errors, write);
+  }
+}
+
+static gboolean
+submit_batch_io_uring_locked (PpdWriteContext *context,
+                              GArray          *writes,
+                              GHashTable      *errors)
+{
+  guint submitted = 0;
+
+  if (!setup_write_ring ())
+    return FALSE;
+
+  while (submitted < writes->len) {
+    guint n_queued = 0;
+    guint n_submitted;
+    gint64 start;
+    guint i;
+    int ret;
+
+    /* Fill the submission queue, and flush it in one go */
+    while (submitted + n_queued < writes->len) {
+      PendingWrite *write = &g_array_index (writes, PendingWrite, submitted + n_queued);
+      struct io_uring_sqe *sqe;
+
+      sqe = io_uring_get_sqe (&write_ring);
+      if (sqe == NULL)
+        break;
+      io_uring_prep_write (sqe, write->handle->fd, write->value, strlen (write->value), 0);
+      io_uring_sqe_set_data (sqe, write);
+      n_queued++;
+    }
+
+    start = g_get_monotonic_time ();
+    ret = io_uring_submit (&write_ring);
+    if (ret <= 0) {
+      g_debug ("io_uring submission failed: %s", ret < 0 ? g_strerror (-ret) : "nothing submitted");
+      abandon_write_ring (context, writes, submitted, errors);
+      return TRUE;
+    }
+    n_submitted = ret;
+
+    /* Only wait for what the kernel took, the rest is written
+     * synchronously once those completed */
+    for (i = 0; i < n_submitted; i++) {
+      struct io_uring_cqe *cqe;
+      PendingWrite *write;
+
+      ret = io_uring_wait_cqe (&write_ring, &cqe);
+      if (ret < 0) {
+        g_warning ("Could not get io_uring completion: %s", g_strerror (-ret));
+        abandon_write_ring (context, writes, submitted, errors);
+        return TRUE;
+      }
+      write = io_uring_cqe_get_data (cqe);
+      write->completed = TRUE;
+      /* Writes run in parallel, so each one is timed from the submission */
+      ppd_utils_latency_record (write->owner, PPD_LATENCY_WRITE, g_get_monotonic_time () - start);
+      complete_batch_write (context, errors, write, cqe->res);
+      io_uring_cqe_seen (&write_ring, cqe);
+    }
+    if (n_submitted < n_queued) {
+      g_debug ("io_uring only took %u of %u writes", n_submitted, n_queued);
+      abandon_write_ring (context, writes, submitted, errors);
+      return TRUE;
+    }
+    submitted += n_queued;
+  }
+
+  return TRUE;
+}
+
+static gboolean
+submit_batch_io_uring (PpdWriteContext *context,
+                       GArray          *writes,
+                       GHashTable      *errors)
+{
+  gboolean ret;
+
+  G_LOCK (write_ring);
+  ret = submit_batch_io_uring_locked (context, writes, errors);
+  G_UNLOCK (write_ring);
+  return ret;
+}
+#endif
+
+static gboolean
+can_batch_writes (void)
+{
+#if HAVE_IO_URING
+  gboolean ret;
+
+  G_LOCK (write_ring);
+  ret = setup_write_ring ();
+  G_UNLOCK (write_ring);
+  return ret;
+#else
+  return FALSE;
+#endif
+}
+
+/* Starts the writes of a profile transition. Those made through
+ * ppd_utils_write() while the context is current, see
+ * ppd_utils_write_context_push(), have the prior value of the attribute
+ * recorded so that ppd_utils_transaction_rollback() can restore it, and
+ * those to cached handles are queued to be submitted at once by
+ * ppd_utils_write_batch_commit() if io_uring is available. Without it,
+ * ppd_utils_write_plan_apply() already writes in parallel. */
+PpdWriteContext *
+ppd_utils_write_context_new (void)
+{
+  PpdWriteContext *context;
+
+  context = g_new0 (PpdWriteContext, 1);
+  g_atomic_ref_count_init (&context->ref_count);
+  g_mutex_init (&context->lock);
+  context->journal = g_array_new (FALSE, FALSE, sizeof (JournalEntry));
+  g_array_set_clear_func (context->journal, (GDestroyNotify) journal_entry_clear);
+
+  if (can_batch_writes ()) {
+    context->pending_writes = g_array_new (FALSE, FALSE, sizeof (PendingWrite));
+    g_array_set_clear_func (context->pending_writes, (GDestroyNotify) pending_write_clear);
+  }
+
+  return context;
+}
+
+PpdWriteContext *
+ppd_utils_write_context_ref (PpdWriteContext *context)
+{
+  g_atomic_ref_count_inc (&context->ref_count);
+  return context;
+}
+
+void
+ppd_utils_write_context_unref (PpdWriteContext *context)
+{
+  if (context == NULL)
+    return;
+  if (!g_atomic_ref_count_dec (&context->ref_count))
+    return;
+  g_clear_pointer (&context->pending_writes, g_array_unref);
+  g_clear_pointer (&context->journal, g_array_unref);
+  g_mutex_clear (&context->lock);
+  g_free (context);
+}
+
+/* Tags the writes made from now on as belonging to @owner, usually
+ * a driver or action name, which must outlive the context. */
+void
+ppd_utils_write_context_set_owner (PpdWriteContext *context,
+                                   const char      *owner)
+{
+  g_mutex_lock (&context->lock);
+  context->owner = owner;
+  g_mutex_unlock (&context->lock);
+}
+
+/* Makes the ppd_utils_write() calls from this thread, and from the worker
+ * threads started with ppd_utils_task_run_in_thread() or
+ * ppd_utils_write_async(), part of @context until
+ * ppd_utils_write_context_pop() is called. */
+void
+ppd_utils_write_context_push (PpdWriteContext *context)
+{
+  g_warn_if_fail (g_private_get (&current_write_context) == NULL);
+  g_private_set (&current_write_context, context);
+}
+
+void
+ppd_utils_write_context_pop (PpdWriteContext *context)
+{
+  g_warn_if_fail (g_private_get (&current_write_context) == context);
+  g_private_set (&current_write_context, NULL);
+}
+
+typedef struct {
+  GTaskThreadFunc task_func;
+  PpdWriteContext *context;
+} ContextThreadData;
+
+static void
+context_thread_data_free (ContextThreadData *data)
+{
+  ppd_utils_write_context_unref (data->context);
+  g_free (data);
+}
+
+static void
+context_thread_func (GTask        *task,
+                     gpointer      source_object,
+                     gpointer      task_data,
+                     GCancellable *cancellable)
+{
+  ContextThreadData *data = g_object_get_data (G_OBJECT (task), "ppd-write-context");
+
+  g_private_set (&current_write_context, data->context);
+  data->task_func (task, source_object, task_data, cancellable);
+  g_private_set (&current_write_context, NULL);
+}
+
+/* Like g_task_run_in_thread(), but the writes @task_func makes are part
+ * of the write context current in the calling thread, if any. */
+void
+ppd_utils_task_run_in_thread (GTask           *task,
+                              GTaskThreadFunc  task_func)
+{
+  PpdWriteContext *context;
+  ContextThreadData *data;
+
+  context = g_private_get (&current_write_context);
+  if (context == NULL) {
+    g_task_run_in_thread (task, task_func);
+    return;
+  }
+
+  data = g_new0 (ContextThreadData, 1);
+  data->task_func = task_func;
+  data->context = ppd_utils_write_context_ref (context);
+  g_object_set_data_full (G_OBJECT (task), "ppd-write-context",
+                          data, (GDestroyNotify) context_thread_data_free);
+  g_task_run_in_thread (task, context_thread_func);
+}
+
+/* Runs all the writes queued in @context, with a single io_uring
+ * submission if available, and returns a hashtable of owner to the first
+ * #GError for each owner that had a failed write, or %NULL. */
+GHashTable *
+ppd_utils_write_batch_commit (PpdWriteContext *context)
+{
+  g_autoptr(GArray) writes = NULL;
+  g_autoptr(GHashTable) errors = NULL;
+
+  g_mutex_lock (&context->lock);
+  writes = g_steal_pointer (&context->pending_writes);
+  context->owner = NULL;
+  g_mutex_unlock (&context->lock);
+
+  if (writes == NULL || writes->len == 0)
+    return NULL;
+
+  errors = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                  NULL, (GDestroyNotify) g_error_free);
+
+  g_debug ("Committing %u batched writes", writes->len);
+#if HAVE_IO_URING
+  if (!submit_batch_io_uring (context, writes, errors))
+#endif
+  {
+    guint i;
+
+    for (i = 0; i < writes->len; i++)
+      write_pending (context, errors, &g_array_index (writes, PendingWrite, i));
+  }
+
+  if (g_hash_table_size (errors) == 0)
+    return NULL;
+  return g_steal_pointer (&errors);
+}
+
+/* Drops the writes queued in @context without running them, so that
+ * nothing more gets changed after one of the steps of a transition failed. */
+void
+ppd_utils_write_batch_abort (PpdWriteContext *context)
+{
+  g_autoptr(GArray) writes = NULL;
+
+  g_mutex_lock (&context->lock);
+  writes = g_steal_pointer (&context->pending_writes);
+  context->owner = NULL;
+  g_mutex_unlock (&context->lock);
+
+  if (writes != NULL)
+    g_debug ("Dropping %u batched writes", writes->len);
+}
+
+/* Forgets the prior values recorded in @context, once the transition
+ * went through. */
+void
+ppd_utils_transaction_commit (PpdWriteContext *context)
+{
+  g_autoptr(GArray) entries = NULL;
+
+  g_mutex_lock (&context->lock);
+  entries = g_steal_pointer (&context->journal);
+  g_mutex_unlock (&context->lock);
+}
+
+/* Writes back the prior values recorded in @context, most recent first.
+ * All the attributes are restored even if one fails, and the first error
+ * is returned. The batched writes must have been committed or aborted. */
+gboolean
+ppd_utils_transaction_rollback (PpdWriteContext  *context,
+                                GError          **error)
+{
+  g_autoptr(GArray) entries = NULL;
+  gboolean ret = TRUE;
+  guint i;
+
+  g_return_val_if_fail (!write_context_is_batching (context), FALSE);
+
+  g_mutex_lock (&context->lock);
+  entries = g_steal_pointer (&context->journal);
+  g_mutex_unlock (&context->lock);
+
+  if (entries == NULL || entries->len == 0)
+    return TRUE;
+
+  /* Not part of any context, so these aren't queued nor recorded */
+  g_debug ("Rolling back %u writes", entries->len);
+  for (i = entries->len; i > 0; i--) {
+    JournalEntry *entry = &g_array_index (entries, JournalEntry, i - 1);
+    g_autoptr(GError) local_error = NULL;
+
+    if (entry->previous == NULL) {
+      if (ret)
+        g_set_error (error, G_IO_ERROR, G_IO_ERROR_FAILED,
+                     "Could not restore '%s', its previous value is unknown",
+                     entry->filename);
+      ret = FALSE;
+      continue;
+    }
+    if (ppd_utils_write (entry->filename, entry->previous, &local_error))
+      continue;
+    if (ret)
+      g_propagate_error (error, g_steal_pointer (&local_error));
+    ret = FALSE;
+  }
+
+  return ret;
+}
+
+typedef struct {
+  char *filename;
+  char *value;
+} WriteData;
+
+static void
+write_data_free (WriteData *data)
+{
+  g_free (data->filename);
+  g_free (data->value);
+  g_free (data);
+}
+
+static void
+write_thread (GTask        *task,
+              gpointer      source_object,
+              gpointer      task_data,
+              GCancellable *cancellable)
+{
+  WriteData *data = task_data;
+  GError *error = NULL;
+
+  if (!ppd_utils_write (data->filename, data->value, &error))
+    g_task_return_error (task, error);
+  else
+    g_task_return_boolean (task, TRUE);
+}
+
+/* Runs ppd_utils_write() from a worker thread, for attributes that can
+ * take a while to write, such as the ones implemented by the firmware. */
+void
+ppd_utils_write_async (const char          *filename,
+                       const char          *value,
+                       GCancellable        *cancellable,
+                       GAsyncReadyCallback  callback,
+                       gpointer             user_data)
+{
+  g_autoptr(GTask) task = NULL;
+  WriteData *data;
+
+  g_return_if_fail (filename);
+  g_return_if_fail (value);
+
+  data = g_new0 (WriteData, 1);
+  data->filename = g_strdup (filename);
+  data->value = g_strdup (value);
+
+  task = g_task_new (NULL, cancellable, callback, user_data);
+  g_task_set_source_tag (task, ppd_utils_write_async);
+  g_task_set_task_data (task, data, (GDestroyNotify) write_data_free);
+  ppd_utils_task_run_in_thread (task, write_thread);
+}
+
+gboolean
+ppd_utils_write_finish (GAsyncResult  *result,
+                        GError       **error)
+{
+  g_return_val_if_fail (g_task_is_valid (result, NULL), FALSE);
+  g_return_val_if_fail (g_async_result_is_tagged (result, ppd_utils_write_async), FALSE);
+
+  return g_task_propagate_boolean (G_TASK (result), error);
+}
+
 gboolean ppd_utils_write_sysfs (GUdevDevice  *device,
                                 const char   *attribute,
                                 const char   *value,
@@ -124,3 +1481,278 @@ ppd_utils_find_device (const char   *subsystem,
 
   return ret;
 }
+
+GUdevDevice *
+ppd_utils_get_device (const char *sysfs_path)
+{
+  g_autoptr(GUdevClient) client = NULL;
+
+  g_return_val_if_fail (sysfs_path != NULL, NULL);
+
+  client = g_udev_client_new (NULL);
+  return g_udev_client_query_by_sysfs_path (client, sysfs_path);
+}
+
+/* Hashes what the probe results depend on, so that a cache written on
+ * other hardware, another kernel, or in another pstate mode is ignored */
+static char *
+compute_hardware_fingerprint (void)
+{
+  const char *files[] = {
+    "/sys/class/dmi/id/modalias",
+    "/sys/devices/system/cpu/present",
+    "/sys/devices/system/cpu/intel_pstate/status",
+    "/sys/devices/system/cpu/amd_pstate/status",
+  };
+  g_autoptr(GChecksum) checksum = NULL;
+  g_autofree char *num_cpus = NULL;
+  struct utsname uts;
+  guint i;
+
+  checksum = g_checksum_new (G_CHECKSUM_SHA256);
+  g_checksum_update (checksum, (const guchar *) VERSION, -1);
+
+  for (i = 0; i < G_N_ELEMENTS (files); i++) {
+    g_autofree char *path = NULL;
+    g_autofree char *contents = NULL;
+    gsize len;
+
+    path = ppd_utils_get_sysfs_path (files[i]);
+    g_checksum_update (checksum, (const guchar *) files[i], -1);
+    if (g_file_get_contents (path, &contents, &len, NULL))
+      g_checksum_update (checksum, (const guchar *) contents, len);
+  }
+
+  if (uname (&uts) == 0)
+    g_checksum_update (checksum, (const guchar *) uts.release, -1);
+  num_cpus = g_strdup_printf ("%u", g_get_num_processors ());
+  g_checksum_update (checksum, (const guchar *) num_cpus, -1);
+
+  return g_strdup (g_checksum_get_string (checksum));
+}
+
+/* Loads the results of previous probes from @path, unless they were
+ * saved on different hardware, in which case drivers probe from scratch,
+ * and their new results get saved by ppd_utils_probe_cache_save(). */
+void
+ppd_utils_probe_cache_load (const char *path)
+{
+  g_autoptr(GError) error = NULL;
+  g_autofree char *fingerprint = NULL;
+  g_autofree char *cached_fingerprint = NULL;
+
+  g_return_if_fail (path != NULL);
+
+  fingerprint = compute_hardware_fingerprint ();
+
+  G_LOCK (probe_cache);
+  g_clear_pointer (&probe_cache, g_key_file_unref);
+  g_free (probe_cache_path);
+  probe_cache_path = g_strdup (path);
+  probe_cache = g_key_file_new ();
+  probe_cache_dirty = FALSE;
+
+  if (!g_key_file_load_from_file (probe_cache, path, G_KEY_FILE_NONE, &error))
+    g_debug ("Could not load probe cache '%s': %s", path, error->message);
+  cached_fingerprint = g_key_file_get_string (probe_cache, PROBE_CACHE_GROUP,
+                                              PROBE_CACHE_FINGERPRINT_KEY, NULL);
+  if (g_strcmp0 (cached_fingerprint, fingerprint) != 0) {
+    if (cached_fingerprint != NULL)
+      g_debug ("Hardware changed, discarding probe cache");
+    g_key_file_unref (probe_cache);
+    probe_cache = g_key_file_new ();
+    g_key_file_set_string (probe_cache, PROBE_CACHE_GROUP,
+                           PROBE_CACHE_FINGERPRINT_KEY, fingerprint);
+    probe_cache_dirty = TRUE;
+  }
+  G_UNLOCK (probe_cache);
+}
+
+/* Writes the probe results stored since loading, if any changed */
+void
+ppd_utils_probe_cache_save (void)
+{
+  g_autoptr(GError) error = NULL;
+
+  G_LOCK (probe_cache);
+  if (probe_cache != NULL && probe_cache_dirty) {
+    if (!g_key_file_save_to_file (probe_cache, probe_cache_path, &error))
+      g_debug ("Could not save probe cache '%s': %s", probe_cache_path, error->message);
+    probe_cache_dirty = FALSE;
+  }
+  G_UNLOCK (probe_cache);
+}
+
+/* Drops what @driver_name stored, or everything if %NULL, for probes
+ * that follow a hardware change the fingerprint might not cover. The
+ * fingerprint is computed again in the latter case. */
+void
+ppd_utils_probe_cache_invalidate (const char *driver_name)
+{
+  g_autofree char *fingerprint = NULL;
+
+  if (driver_name == NULL)
+    fingerprint = compute_hardware_fingerprint ();
+
+  G_LOCK (probe_cache);
+  if (probe_cache == NULL)
+    goto out;
+
+  if (driver_name != NULL) {
+    if (g_key_file_remove_group (probe_cache, driver_name, NULL))
+      probe_cache_dirty = TRUE;
+    goto out;
+  }
+
+  g_key_file_unref (probe_cache);
+  probe_cache = g_key_file_new ();
+  g_key_file_set_string (probe_cache, PROBE_CACHE_GROUP,
+                         PROBE_CACHE_FINGERPRINT_KEY, fingerprint);
+  probe_cache_dirty = TRUE;
+
+out:
+  G_UNLOCK (probe_cache);
+}
+
+/* Returns what @driver_name stored as @key when it last probed on this
+ * hardware, or %NULL. Drivers need to check that the returned values are
+ * still valid, and probe from scratch otherwise. */
+char **
+ppd_utils_probe_cache_lookup (const char *driver_name,
+                              const char *key)
+{
+  char **ret = NULL;
+
+  g_return_val_if_fail (driver_name != NULL, NULL);
+  g_return_val_if_fail (key != NULL, NULL);
+
+  G_LOCK (probe_cache);
+  if (probe_cache != NULL)
+    ret = g_key_file_get_string_list (probe_cache, driver_name, key, NULL, NULL);
+  G_UNLOCK (probe_cache);
+
+  return ret;
+}
+
+void
+ppd_utils_probe_cache_store (const char         *driver_name,
+                             const char         *key,
+                             const char * const *values)
+{
+  g_auto(GStrv) old_values = NULL;
+
+  g_return_if_fail (driver_name != NULL);
+  g_return_if_fail (key != NULL);
+  g_return_if_fail (values != NULL);
+
+  G_LOCK (probe_cache);
+  if (probe_cache == NULL)
+    goto out;
+  old_values = g_key_file_get_string_list (probe_cache, driver_name, key, NULL, NULL);
+  if (old_values != NULL && g_strv_equal ((const char * const *) old_values, values))
+    goto out;
+  g_key_file_set_string_list (probe_cache, driver_name, key, values, g_strv_length ((char **) values));
+  probe_cache_dirty = TRUE;
+
+out:
+  G_UNLOCK (probe_cache);
+}
+
+/* Adds @duration, in microseconds, to @stats. Bucket n counts the
+ * durations between 2^n and 2^(n+1) microseconds, and the last bucket
+ * all the longer ones. */
+void
+ppd_utils_latency_stats_add (PpdLatencyStats *stats,
+                             gint64           duration)
+{
+  guint64 value = MAX (duration, 0);
+  guint bucket;
+
+  bucket = value > 1 ? g_bit_storage (value) - 1 : 0;
+  bucket = MIN (bucket, PPD_LATENCY_BUCKETS - 1);
+
+  stats->count++;
+  stats->total += value;
+  stats->max = MAX (stats->max, value);
+  stats->buckets[bucket]++;
+}
+
+/* Returns: (transfer floating): @stats as a (count, total, max, buckets)
+ * "(tttat)" tuple */
+GVariant *
+ppd_utils_latency_stats_to_variant (const PpdLatencyStats *stats)
+{
+  return g_variant_new ("(ttt@at)", stats->count, stats->total, stats->max,
+                        g_variant_new_fixed_array (G_VARIANT_TYPE_UINT64, stats->buckets,
+                                                   PPD_LATENCY_BUCKETS, sizeof (guint64)));
+}
+
+/* Records that @operation, one of the PPD_LATENCY_* names, took
+ * @duration microseconds for @owner, a driver or action name, or %NULL
+ * for work outside profile transitions. This can be called from any thread. */
+void
+ppd_utils_latency_record (const char *owner,
+                          const char *operation,
+                          gint64      duration)
+{
+  GHashTable *operations;
+  PpdLatencyStats *stats;
+
+  if (owner == NULL)
+    owner = "other";
+
+  G_LOCK (latency_stats);
+  if (latency_stats == NULL)
+    latency_stats = g_hash_table_new_full (g_str_hash, g_str_equal,
+                                           g_free, (GDestroyNotify) g_hash_table_unref);
+
+  operations = g_hash_table_lookup (latency_stats, owner);
+  if (operations == NULL) {
+    operations = g_hash_table_new_full (g_str_hash, g_str_equal, NULL, g_free);
+    g_hash_table_insert (latency_stats, g_strdup (owner), operations);
+  }
+  stats = g_hash_table_lookup (operations, operation);
+  if (stats == NULL) {
+    stats = g_new0 (PpdLatencyStats, 1);
+    g_hash_table_insert (operations, (gpointer) operation, stats);
+  }
+
+  ppd_utils_latency_stats_add (stats, duration);
+  G_UNLOCK (latency_stats);
+}
+
+/* Returns: (transfer floating): the recorded latencies as an
+ * "a{sa{s(tttat)}}" dictionary of owner to operation to statistics */
+GVariant *
+ppd_utils_latency_get_variant (void)
+{
+  GVariantBuilder builder;
+  GHashTableIter iter;
+  gpointer key, value;
+
+  g_variant_builder_init (&builder, G_VARIANT_TYPE ("a{sa{s(tttat)}}"));
+
+  G_LOCK (latency_stats);
+  if (latency_stats == NULL)
+    goto out;
+
+  g_hash_table_iter_init (&iter, latency_stats);
+  while (g_hash_table_iter_next (&iter, &key, &value)) {
+    GHashTableIter operations_iter;
+    gpointer operation, stats;
+
+    g_variant_builder_open (&builder, G_VARIANT_TYPE ("{sa{s(tttat)}}"));
+    g_variant_builder_add (&builder, "s", key);
+    g_variant_builder_open (&builder, G_VARIANT_TYPE ("a{s(tttat)}"));
+    g_hash_table_iter_init (&operations_iter, value);
+    while (g_hash_table_iter_next (&operations_iter, &operation, &stats))
+      g_variant_builder_add (&builder, "{s@(tttat)}", operation,
+                             ppd_utils_latency_stats_to_variant (stats));
+    g_variant_builder_close (&builder);
+    g_variant_builder_close (&builder);
+  }
+
+out:
+  G_UNLOCK (latency_stats);
+  return g_variant_builder_end (&builder);
+}
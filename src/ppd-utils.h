@@ -12,10 +12,77 @@
 #include <gudev/gudev.h>
 #include <gio/gio.h>
 
+#include "ppd-profile.h"
+
+typedef struct _PpdWritePlan PpdWritePlan;
+typedef struct _PpdWriteContext PpdWriteContext;
+
+/* Operations whose latencies are recorded */
+#define PPD_LATENCY_PROBE            "probe"
+#define PPD_LATENCY_ACTIVATE_PROFILE "activate_profile"
+#define PPD_LATENCY_WRITE            "write"
+
+#define PPD_LATENCY_BUCKETS 24
+
+typedef struct {
+  guint64 count;
+  guint64 total; /* in microseconds */
+  guint64 max;
+  guint64 buckets[PPD_LATENCY_BUCKETS];
+} PpdLatencyStats;
+
+typedef const char * (*PpdWritePlanValueFunc) (PpdProfile profile);
+
+typedef struct {
+  GPtrArray *filenames;
+  PpdWritePlanValueFunc value_func;
+} PpdWritePlanGroup;
+
 char * ppd_utils_get_sysfs_path (const char *filename);
 gboolean ppd_utils_write (const char  *filename,
                           const char  *value,
                           GError     **error);
+void ppd_utils_write_async (const char          *filename,
+                            const char          *value,
+                            GCancellable        *cancellable,
+                            GAsyncReadyCallback  callback,
+                            gpointer             user_data);
+gboolean ppd_utils_write_finish (GAsyncResult  *result,
+                                 GError       **error);
+PpdWritePlan *ppd_utils_write_plan_new (const PpdWritePlanGroup *groups,
+                                        guint                    n_groups);
+PpdWritePlan *ppd_utils_write_plan_ref (PpdWritePlan *plan);
+void ppd_utils_write_plan_unref (PpdWritePlan *plan);
+gboolean ppd_utils_write_plan_contains (const PpdWritePlan *plan,
+                                        const char         *filename);
+PpdWritePlan *ppd_utils_write_plan_add (const PpdWritePlan *plan,
+                                        guint               group,
+                                        const char         *filename);
+PpdWritePlan *ppd_utils_write_plan_remove (const PpdWritePlan *plan,
+                                           const char         *filename);
+void ppd_utils_write_plan_close_handles (const PpdWritePlan *plan);
+gboolean ppd_utils_write_plan_apply (const PpdWritePlan  *plan,
+                                     PpdProfile           profile,
+                                     GError             **error);
+PpdWriteContext *ppd_utils_write_context_new (void);
+PpdWriteContext *ppd_utils_write_context_ref (PpdWriteContext *context);
+void ppd_utils_write_context_unref (PpdWriteContext *context);
+void ppd_utils_write_context_set_owner (PpdWriteContext *context,
+                                        const char      *owner);
+void ppd_utils_write_context_push (PpdWriteContext *context);
+void ppd_utils_write_context_pop (PpdWriteContext *context);
+void ppd_utils_task_run_in_thread (GTask           *task,
+                                   GTaskThreadFunc  task_func);
+GHashTable *ppd_utils_write_batch_commit (PpdWriteContext *context);
+void ppd_utils_write_batch_abort (PpdWriteContext *context);
+void ppd_utils_transaction_commit (PpdWriteContext *context);
+gboolean ppd_utils_transaction_rollback (PpdWriteContext  *context,
+                                         GError          **error);
+gboolean ppd_utils_sysfs_cache_open (const char  *filename,
+                                     GError     **error);
+void ppd_utils_sysfs_cache_close (const char *filename);
+void ppd_utils_sysfs_cache_invalidate (const char *prefix);
+void ppd_utils_sysfs_cache_verify (const char *prefix);
 gboolean ppd_utils_write_sysfs (GUdevDevice  *device,
                                 const char   *attribute,
                                 const char   *value,
@@ -26,3 +93,22 @@ GFileMonitor *ppd_utils_monitor_sysfs_attr (GUdevDevice  *device,
 GUdevDevice *ppd_utils_find_device (const char   *subsystem,
                                     GCompareFunc  func,
                                     gpointer      user_data);
+GUdevDevice *ppd_utils_get_device (const char *sysfs_path);
+void ppd_utils_probe_cache_load (const char *path);
+void ppd_utils_probe_cache_save (void);
+void ppd_utils_probe_cache_invalidate (const char *driver_name);
+char **ppd_utils_probe_cache_lookup (const char *driver_name,
+                                     const char *key);
+void ppd_utils_probe_cache_store (const char         *driver_name,
+                                  const char         *key,
+                                  const char * const *values);
+void ppd_utils_latency_stats_add (PpdLatencyStats *stats,
+                                  gint64           duration);
+GVariant *ppd_utils_latency_stats_to_variant (const PpdLatencyStats *stats);
+void ppd_utils_latency_record (const char *owner,
+                               const char *operation,
+                               gint64      duration);
+GVariant *ppd_utils_latency_get_variant (void);
+
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdWritePlan, ppd_utils_write_plan_unref)
+G_DEFINE_AUTOPTR_CLEANUP_FUNC (PpdWriteContext, ppd_utils_write_context_unref)
@@ -19,7 +19,9 @@
 # MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
 # GNU General Public License for more details.
 
+import mmap
 import os
+import struct
 import sys
 import dbus
 import tempfile
@@ -142,15 +144,20 @@ class Tests(dbusmock.DBusTestCase):
             os.remove(self.testbed.get_root_dir() + '/' + 'ppd_test_conf.ini')
         except Exception:
             pass
+        try:
+            os.remove(self.testbed.get_root_dir() + '/' + 'ppd_test_probe_cache.ini')
+        except Exception:
+            pass
 
     #
     # Daemon control and D-BUS I/O
     #
 
-    def start_daemon(self):
+    def start_daemon(self, args=[]):
         '''Start daemon and create DBus proxy.
 
         When done, this sets self.proxy as the Gio.DBusProxy for power-profiles-daemon.
+        args are passed to the daemon on top of the verbose flag.
         '''
         env = os.environ.copy()
         env['G_DEBUG'] = 'fatal-criticals'
@@ -160,9 +167,9 @@ class Tests(dbusmock.DBusTestCase):
         env['UMOCKDEV_DIR'] = self.testbed.get_root_dir()
         self.log = tempfile.NamedTemporaryFile()
         if os.getenv('VALGRIND') != None:
-            daemon_path = ['valgrind', self.daemon_path, '-v']
+            daemon_path = ['valgrind', self.daemon_path, '-v'] + args
         else:
-            daemon_path = [self.daemon_path, '-v']
+            daemon_path = [self.daemon_path, '-v'] + args
 
         self.daemon = subprocess.Popen(daemon_path,
                                        env=env, stdout=self.log,
@@ -473,6 +480,37 @@ class Tests(dbusmock.DBusTestCase):
       upowerd.wait()
       upowerd.stdout.close()
 
+    def test_intel_pstate_no_change(self):
+      '''Intel P-State driver doesn't rewrite unchanged values'''
+
+      dir1 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/")
+      os.makedirs(dir1)
+      gov_path = os.path.join(dir1, 'scaling_governor')
+      with open(gov_path, 'w') as gov:
+        gov.write('powersave\n')
+      pref_path = os.path.join(dir1, "energy_performance_preference")
+      with open(pref_path,'w') as prefs:
+        prefs.write("balance_performance\n")
+      pstate_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate")
+      os.makedirs(pstate_dir)
+      with open(os.path.join(pstate_dir, "status"),'w') as status:
+        status.write("active\n")
+
+      gov_mtime = os.path.getmtime(gov_path)
+      pref_mtime = os.path.getmtime(pref_path)
+      self.start_daemon()
+
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'balanced')
+      # Verify that neither the governor nor the preference got touched
+      self.assertEqual(os.path.getmtime(gov_path), gov_mtime)
+      self.assertEqual(os.path.getmtime(pref_path), pref_mtime)
+
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('performance'))
+      with open(pref_path, 'rb') as f:
+        self.assertEqual(f.read(), b'performance')
+
+      self.stop_daemon()
+
     def test_intel_pstate_error(self):
       '''Intel P-State driver in error state'''
 
@@ -515,6 +553,132 @@ class Tests(dbusmock.DBusTestCase):
       if os.geteuid() == 0:
         subprocess.check_output(['chattr', '-i', pref_path])
 
+    def test_intel_pstate_rollback(self):
+      '''Intel P-State driver rolls back partially applied profiles'''
+
+      pstate_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate")
+      os.makedirs(pstate_dir)
+      with open(os.path.join(pstate_dir, "status"),'w') as status:
+        status.write("active\n")
+
+      dir1 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/")
+      os.makedirs(dir1)
+      with open(os.path.join(dir1, 'scaling_governor'), 'w') as gov:
+        gov.write('powersave\n')
+      with open(os.path.join(dir1, "energy_performance_preference"),'w') as prefs:
+        prefs.write("balance_performance\n")
+
+      dir2 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy1/")
+      os.makedirs(dir2)
+      with open(os.path.join(dir2, 'scaling_governor'), 'w') as gov:
+        gov.write('powersave\n')
+      pref_path = os.path.join(dir2, "energy_performance_preference")
+      old_umask = os.umask(0o333)
+      with open(pref_path,'w') as prefs:
+        prefs.write("balance_performance\n")
+      os.umask(old_umask)
+      # Make file non-writable to root
+      if os.geteuid() == 0:
+        if not GLib.find_program_in_path('chattr'):
+          os._exit(77)
+        subprocess.check_output(['chattr', '+i', pref_path])
+
+      self.start_daemon()
+
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'balanced')
+
+      # The CPU that could be switched goes back to the previous value
+      with self.assertRaises(gi.repository.GLib.GError):
+        self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('performance'))
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'balanced')
+
+      contents = None
+      with open(os.path.join(dir1, "energy_performance_preference"), 'rb') as f:
+        contents = f.read()
+      self.assertEqual(contents.strip(), b'balance_performance')
+
+      self.stop_daemon()
+
+      if os.geteuid() == 0:
+        subprocess.check_output(['chattr', '-i', pref_path])
+
+    def test_intel_pstate_hotplug(self):
+      '''Intel P-State driver applies the profile to hotplugged CPUs'''
+
+      dir1 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/")
+      os.makedirs(dir1)
+      with open(os.path.join(dir1, 'scaling_governor'), 'w') as gov:
+        gov.write('powersave\n')
+      with open(os.path.join(dir1, "energy_performance_preference"),'w') as prefs:
+        prefs.write("performance\n")
+
+      pstate_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate")
+      os.makedirs(pstate_dir)
+      with open(os.path.join(pstate_dir, "status"),'w') as status:
+        status.write("active\n")
+
+      self.start_daemon()
+
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('power-saver'))
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'power-saver')
+
+      # Bring a second CPU online
+      dir2 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy1/")
+      os.makedirs(dir2)
+      with open(os.path.join(dir2, 'scaling_governor'), 'w') as gov:
+        gov.write('powersave\n')
+      with open(os.path.join(dir2, "energy_performance_preference"),'w') as prefs:
+        prefs.write("performance\n")
+      self.testbed.add_device('cpu', 'cpu1', None, [ 'online', '1' ], [])
+
+      def read_pref():
+        with open(os.path.join(dir2, "energy_performance_preference"), 'rb') as f:
+          return f.read()
+      self.assertEventually(lambda: read_pref() == b'power')
+
+      # And it follows the next profile changes
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('performance'))
+      self.assertEqual(read_pref(), b'performance')
+
+      self.stop_daemon()
+
+    def test_intel_pstate_probe_cache(self):
+      '''Intel P-State driver reuses the previous probe results'''
+
+      dir1 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/")
+      os.makedirs(dir1)
+      with open(os.path.join(dir1, 'scaling_governor'), 'w') as gov:
+        gov.write('powersave\n')
+      with open(os.path.join(dir1, "energy_performance_preference"),'w') as prefs:
+        prefs.write("performance\n")
+
+      pstate_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate")
+      os.makedirs(pstate_dir)
+      with open(os.path.join(pstate_dir, "status"),'w') as status:
+        status.write("active\n")
+
+      self.start_daemon()
+      self.assertFalse(self.have_text_in_log('Using cached EPP preferences'))
+      self.stop_daemon()
+
+      self.assertTrue(os.path.exists(os.path.join(self.testbed.get_root_dir(), 'ppd_test_probe_cache.ini')))
+
+      self.start_daemon()
+      self.assertTrue(self.have_text_in_log('Using cached EPP preferences'))
+      self.assertEqual(self.get_dbus_property('Profiles')[0]['Driver'], 'intel_pstate')
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('performance'))
+      with open(os.path.join(dir1, "energy_performance_preference"), 'rb') as f:
+        self.assertEqual(f.read(), b'performance')
+      self.stop_daemon()
+
+      # Switching to passive mode changes the fingerprint
+      with open(os.path.join(pstate_dir, "status"),'w') as status:
+        status.write("passive\n")
+      self.start_daemon()
+      self.assertTrue(self.have_text_in_log('discarding probe cache'))
+      self.assertEqual(self.get_dbus_property('Profiles')[0]['Driver'], 'placeholder')
+      self.stop_daemon()
+
     def test_intel_pstate_passive(self):
       '''Intel P-State in passive mode -> placeholder'''
 
@@ -605,6 +769,47 @@ class Tests(dbusmock.DBusTestCase):
 
       self.stop_daemon()
 
+    def test_intel_pstate_epb_resume(self):
+      '''Intel P-State driver re-applies energy_perf_bias on resume'''
+
+      dir1 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/")
+      os.makedirs(dir1)
+      with open(os.path.join(dir1, 'scaling_governor'), 'w') as gov:
+        gov.write('powersave\n')
+      dir2 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpu0/power/")
+      os.makedirs(dir2)
+      epb_path = os.path.join(dir2, 'energy_perf_bias')
+      with open(epb_path, 'w') as epb:
+        epb.write("6")
+
+      pstate_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate")
+      os.makedirs(pstate_dir)
+      with open(os.path.join(pstate_dir, "status"),'w') as status:
+        status.write("passive\n")
+
+      logind, obj_logind = self.spawn_server_template(
+            'logind', {}, stdout=subprocess.PIPE)
+
+      self.start_daemon()
+      self.assertEqual(self.get_dbus_property('Profiles')[0]['Driver'], 'intel_pstate')
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('power-saver'))
+      self.assertEqual(self.read_sysfs_file("sys/devices/system/cpu/cpu0/power/energy_perf_bias"), b'15')
+
+      # The firmware resets the value on resume
+      with open(epb_path, 'w') as epb:
+        epb.write("6")
+
+      def resume():
+        obj_logind.EmitSignal('org.freedesktop.login1.Manager', 'PrepareForSleep', 'b', [False])
+        return self.read_sysfs_file("sys/devices/system/cpu/cpu0/power/energy_perf_bias") == b'15'
+      self.assertEventually(resume)
+
+      self.stop_daemon()
+
+      logind.terminate()
+      logind.wait()
+      logind.stdout.close()
+
     def test_amd_pstate(self):
       '''AMD P-State driver (no UPower)'''
 
@@ -659,6 +864,49 @@ class Tests(dbusmock.DBusTestCase):
       self.assertEqual(len(profiles), 3)
       self.assertEqual(profiles[0]['Driver'], 'platform_profile')
 
+    def test_amd_pstate_resume(self):
+      '''AMD P-State driver preferences are re-applied on resume if they drifted'''
+
+      for policy in ['policy0', 'policy1']:
+        policy_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/", policy)
+        os.makedirs(policy_dir)
+        with open(os.path.join(policy_dir, 'scaling_governor'), 'w') as gov:
+          gov.write('powersave\n')
+        with open(os.path.join(policy_dir, "energy_performance_preference"),'w') as prefs:
+          prefs.write("performance\n")
+
+      pstate_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/amd_pstate")
+      os.makedirs(pstate_dir)
+      with open(os.path.join(pstate_dir, "status"),'w') as status:
+        status.write("active\n")
+
+      logind, obj_logind = self.spawn_server_template(
+            'logind', {}, stdout=subprocess.PIPE)
+
+      self.start_daemon()
+      self.assertEqual(self.get_dbus_property('Profiles')[0]['Driver'], 'amd_pstate')
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('power-saver'))
+      self.assertEqual(self.read_sysfs_file("sys/devices/system/cpu/cpufreq/policy1/energy_performance_preference"), b'power')
+
+      # The firmware resets one of the policies on resume
+      with open(os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy1/energy_performance_preference"), 'w') as prefs:
+        prefs.write("performance\n")
+      mtime = self.get_mtime("sys/devices/system/cpu/cpufreq/policy0", "energy_performance_preference")
+
+      def resume():
+        obj_logind.EmitSignal('org.freedesktop.login1.Manager', 'PrepareForSleep', 'b', [False])
+        return self.read_sysfs_file("sys/devices/system/cpu/cpufreq/policy1/energy_performance_preference") == b'power'
+      self.assertEventually(resume)
+      self.assertTrue(self.have_text_in_log("for reason 'resume'"))
+      self.assertEqual(self.get_mtime("sys/devices/system/cpu/cpufreq/policy0", "energy_performance_preference"), mtime)
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'power-saver')
+
+      self.stop_daemon()
+
+      logind.terminate()
+      logind.wait()
+      logind.stdout.close()
+
     def test_amd_pstate_balance(self):
       '''AMD P-State driver (balance)'''
 
@@ -1009,6 +1257,156 @@ class Tests(dbusmock.DBusTestCase):
 
       self.stop_daemon()
 
+    def test_hold_release_profiles(self):
+      '''Batched holds are applied in a single transition'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      cookies = self.call_dbus_method('HoldProfiles', GLib.Variant("(a(sss))", ([
+          ('performance', 'task1', 'runner'),
+          ('performance', 'task2', 'runner'),
+          ('power-saver', 'task3', 'runner')],)))
+      cookies = cookies.unpack()[0]
+      self.assertEqual(len(cookies), 3)
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 3)
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'power-saver')
+      self.assertEqual(self.count_text_in_log("for reason 'program-hold'"), 1)
+
+      # Nothing is held or released if any of the arguments is invalid
+      with self.assertRaises(gi.repository.GLib.GError) as cm:
+        self.call_dbus_method('HoldProfiles', GLib.Variant("(a(sss))", ([
+            ('performance', '', ''),
+            ('balanced', '', '')],)))
+      self.assertIn('InvalidArgs', str(cm.exception))
+      with self.assertRaises(gi.repository.GLib.GError) as cm:
+        self.call_dbus_method('ReleaseProfiles', GLib.Variant("(au)", ([cookies[0], 0],)))
+      self.assertIn('InvalidArgs', str(cm.exception))
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 3)
+
+      self.call_dbus_method('ReleaseProfiles', GLib.Variant("(au)", (cookies,)))
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 0)
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'balanced')
+      self.assertEqual(self.count_text_in_log("for reason 'program-hold'"), 2)
+
+      self.stop_daemon()
+
+    def test_properties_changed_coalesced(self):
+      '''Property changes are sent in a single signal, without unchanged values'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      changes = []
+      def properties_changed_cb(connection, sender, path, iface, signal, params):
+        changes.append(params.unpack()[1])
+      sub_id = self.dbus.signal_subscribe(None, 'org.freedesktop.DBus.Properties',
+          'PropertiesChanged', PP_PATH, None, Gio.DBusSignalFlags.NONE,
+          properties_changed_cb)
+
+      # Property reads send the pending changes first
+      self.get_dbus_property('ActiveProfile')
+      self.assertEventually(lambda: True)
+      changes.clear()
+
+      cookies = self.call_dbus_method('HoldProfiles', GLib.Variant("(a(sss))", ([
+          ('performance', 'task1', 'runner'),
+          ('performance', 'task2', 'runner')],)))
+      self.assertEventually(lambda: len(changes) == 1)
+      self.assertEqual(sorted(changes[0].keys()), ['ActiveProfile', 'ActiveProfileHolds'])
+      self.assertEqual(changes[0]['ActiveProfile'], 'performance')
+      self.assertEqual(len(changes[0]['ActiveProfileHolds']), 2)
+
+      # The active profile does not change, so is not sent again
+      changes.clear()
+      self.call_dbus_method('HoldProfile', GLib.Variant("(sss)", ('performance', 'task3', 'runner')))
+      self.assertEventually(lambda: len(changes) == 1)
+      self.assertEqual(list(changes[0].keys()), ['ActiveProfileHolds'])
+      self.assertEqual(len(changes[0]['ActiveProfileHolds']), 3)
+
+      changes.clear()
+      self.call_dbus_method('ReleaseProfiles', cookies)
+      self.assertEventually(lambda: len(changes) == 1)
+      self.assertEqual(list(changes[0].keys()), ['ActiveProfileHolds'])
+      self.assertEqual(len(changes[0]['ActiveProfileHolds']), 1)
+
+      self.dbus.signal_unsubscribe(sub_id)
+      self.stop_daemon()
+
+    def test_hold_lease(self):
+      '''Holds with a lease are released once it expires'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      forever = self.call_dbus_method('HoldProfileWithLease', GLib.Variant("(sssu)", ('performance', '', 'forever', 0)))
+      renewed = self.call_dbus_method('HoldProfileWithLease', GLib.Variant("(sssu)", ('power-saver', '', 'renewed', 2)))
+      self.call_dbus_method('HoldProfileWithLease', GLib.Variant("(sssu)", ('power-saver', '', 'expiring', 2)))
+      self.call_dbus_method('HoldProfileWithLease', GLib.Variant("(sssu)", ('power-saver', '', 'expiring', 2)))
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 4)
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'power-saver')
+
+      with self.assertRaises(gi.repository.GLib.GError) as cm:
+        self.call_dbus_method('RenewProfile', forever)
+      self.assertIn('InvalidArgs', str(cm.exception))
+
+      # Only the holder can renew its holds
+      client = Gio.DBusConnection.new_for_address_sync(self.test_bus.get_bus_address(),
+          Gio.DBusConnectionFlags.AUTHENTICATION_CLIENT | Gio.DBusConnectionFlags.MESSAGE_BUS_CONNECTION,
+          None, None)
+      with self.assertRaises(gi.repository.GLib.GError) as cm:
+        client.call_sync(PP, PP_PATH, PP_INTERFACE, 'RenewProfile', renewed, None,
+            Gio.DBusCallFlags.NO_AUTO_START, -1, None)
+      self.assertIn('AccessDenied', str(cm.exception))
+      client.close_sync(None)
+
+      time.sleep(1)
+      self.call_dbus_method('RenewProfile', renewed)
+
+      # Both expiring holds are released together
+      self.assertEventually(lambda: len(self.get_dbus_property('ActiveProfileHolds')) == 2)
+      self.assertEqual(self.count_text_in_log("for reason 'program-hold'"), 1)
+
+      self.assertEventually(lambda: len(self.get_dbus_property('ActiveProfileHolds')) == 1)
+      self.assertEqual(self.get_dbus_property('ActiveProfileHolds')[0]['ApplicationId'], 'forever')
+      self.assertEventually(lambda: self.get_dbus_property('ActiveProfile') == 'performance')
+
+      with self.assertRaises(gi.repository.GLib.GError) as cm:
+        self.call_dbus_method('RenewProfile', renewed)
+      self.assertIn('InvalidArgs', str(cm.exception))
+
+      self.stop_daemon()
+
+    def test_hold_settle_time(self):
+      '''Lowering performance after a release waits for holds to settle'''
+      self.create_platform_profile()
+      self.start_daemon(['--hold-settle-time=1000'])
+
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'balanced')
+
+      # Raising performance happens straight away
+      cookie = self.call_dbus_method('HoldProfile', GLib.Variant("(sss)", ('performance', '', '')))
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'performance')
+      self.assertEqual(self.read_sysfs_file("sys/firmware/acpi/platform_profile"), b'performance')
+
+      # Lowering it waits for the settle time
+      self.call_dbus_method('ReleaseProfile', GLib.Variant("(u)", cookie))
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 0)
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'performance')
+
+      # A new hold cancels the pending transition
+      cookie = self.call_dbus_method('HoldProfile', GLib.Variant("(sss)", ('performance', '', '')))
+      self.call_dbus_method('ReleaseProfile', GLib.Variant("(u)", cookie))
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'performance')
+      self.assertEventually(lambda: self.get_dbus_property('ActiveProfile') == 'balanced')
+      self.assertEqual(self.read_sysfs_file("sys/firmware/acpi/platform_profile"), b'balanced')
+
+      # Manually selected profiles aren't delayed
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('power-saver'))
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'power-saver')
+
+      self.stop_daemon()
+
     def test_vanishing_hold(self):
       self.create_platform_profile()
       self.start_daemon()
@@ -1034,6 +1432,216 @@ class Tests(dbusmock.DBusTestCase):
 
       self.stop_daemon()
 
+    def test_profile_applied(self):
+      '''ProfileApplied is sent once the hardware uses the profile'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      applied = []
+      def profile_applied_cb(connection, sender, path, iface, signal, params):
+        applied.append(params.unpack())
+      sub_id = self.dbus.signal_subscribe(None, PP_INTERFACE, 'ProfileApplied', PP_PATH,
+          None, Gio.DBusSignalFlags.NONE, profile_applied_cb)
+
+      before = time.clock_gettime_ns(time.CLOCK_MONOTONIC) // 1000
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('performance'))
+      self.assertEventually(lambda: len(applied) == 1)
+      transition, profile, reason, timestamp, outcomes, durations = applied[0]
+      self.assertEqual(profile, 'performance')
+      self.assertEqual(reason, 'user')
+      self.assertGreaterEqual(timestamp, before)
+      self.assertEqual(outcomes, {'platform_profile': 'applied'})
+      self.assertEqual(sorted(durations.keys()), ['actions', 'commit', 'driver', 'queue'])
+
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('balanced'))
+      self.assertEventually(lambda: len(applied) == 2)
+      self.assertEqual(applied[1][0], transition + 1)
+      self.dbus.signal_unsubscribe(sub_id)
+
+      # The command only starts once the held profile is applied
+      builddir = os.getenv('top_builddir', '.')
+      tool_path = os.path.join(builddir, 'src', 'powerprofilesctl')
+      output = subprocess.check_output([tool_path, 'launch', '--wait-applied', '-p', 'power-saver',
+          'cat', self.testbed.get_root_dir() + '/sys/firmware/acpi/platform_profile'],
+          stderr=sys.stderr, universal_newlines=True)
+      self.assertEqual(output.strip(), 'low-power')
+
+      self.stop_daemon()
+
+    def test_statistics(self):
+      '''Latencies are recorded per driver, and per reason for transitions'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('performance'))
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('power-saver'))
+
+      operations, transitions = self.call_dbus_method('GetStatistics', None).unpack()
+      driver = operations['platform_profile']
+      self.assertEqual(driver['probe'][0], 1)
+      self.assertGreaterEqual(driver['activate_profile'][0], 3)
+      self.assertGreaterEqual(driver['write'][0], 2)
+      self.assertEqual(transitions['user'][0], 2)
+      self.assertGreaterEqual(transitions['reset'][0], 1)
+
+      count, total, maximum, buckets = transitions['user']
+      self.assertEqual(len(buckets), 24)
+      self.assertEqual(sum(buckets), count)
+      self.assertLessEqual(maximum, total)
+
+      self.stop_daemon()
+
+    def test_hold_for_process(self):
+      '''Process holds last as long as the process, not the caller'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      process = subprocess.Popen(['sleep', '3600'])
+      client = Gio.DBusConnection.new_for_address_sync(self.test_bus.get_bus_address(),
+          Gio.DBusConnectionFlags.AUTHENTICATION_CLIENT | Gio.DBusConnectionFlags.MESSAGE_BUS_CONNECTION,
+          None, None)
+      fd_list = Gio.UnixFDList.new_from_array([os.pidfd_open(process.pid)])
+      client.call_with_unix_fd_list_sync(PP, PP_PATH, PP_INTERFACE, 'HoldProfileForProcess',
+          GLib.Variant('(sssh)', ('power-saver', 'batch job', 'sleep', 0)), None,
+          Gio.DBusCallFlags.NO_AUTO_START, -1, fd_list, None)
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'power-saver')
+
+      # The caller going away doesn't matter
+      client.close_sync(None)
+      time.sleep(0.5)
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 1)
+
+      process.terminate()
+      process.wait()
+      self.assertEventually(lambda: len(self.get_dbus_property('ActiveProfileHolds')) == 0)
+      self.assertEventually(lambda: self.get_dbus_property('ActiveProfile') == 'balanced')
+
+      # File descriptors that aren't pidfds are refused
+      with open(os.devnull) as f:
+        fd_list = Gio.UnixFDList.new_from_array([os.dup(f.fileno())])
+        with self.assertRaises(gi.repository.GLib.GError) as cm:
+          self.dbus.call_with_unix_fd_list_sync(PP, PP_PATH, PP_INTERFACE, 'HoldProfileForProcess',
+              GLib.Variant('(sssh)', ('power-saver', '', '', 0)), None,
+              Gio.DBusCallFlags.NO_AUTO_START, -1, fd_list, None)
+        self.assertIn('InvalidArgs', str(cm.exception))
+
+      self.stop_daemon()
+
+    def test_state_page(self):
+      '''The state page mirrors the daemon state'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      reply, fd_list = self.dbus.call_with_unix_fd_list_sync(PP, PP_PATH, PP_INTERFACE, 'GetStatePage',
+          None, GLib.VariantType('(h)'), Gio.DBusCallFlags.NO_AUTO_START, -1, None, None)
+      fd = fd_list.get(reply.unpack()[0])
+      page = mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ)
+      os.close(fd)
+
+      def read_page():
+        while True:
+          sequence = struct.unpack_from('=i', page)[0]
+          if sequence % 2 == 1:
+            continue
+          state = struct.unpack_from('=iIIIQ16s16s128s', page)
+          if state[0] == sequence:
+            return [v.split(b'\0')[0].decode() if isinstance(v, bytes) else v for v in state[1:]]
+
+      version, hold_count, _, transitions, active, selected, degraded = read_page()
+      self.assertEqual(version, 1)
+      self.assertEqual(hold_count, 0)
+      self.assertEqual(active, 'balanced')
+      self.assertEqual(selected, 'balanced')
+      self.assertEqual(degraded, '')
+
+      self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('performance'))
+      _, hold_count, _, new_transitions, active, selected, _ = read_page()
+      self.assertEqual(active, 'performance')
+      self.assertEqual(selected, 'performance')
+      self.assertGreater(new_transitions, transitions)
+
+      self.call_dbus_method('HoldProfile', GLib.Variant("(sss)", ('power-saver', '', '')))
+      _, hold_count, _, _, active, selected, _ = read_page()
+      self.assertEqual(hold_count, 1)
+      self.assertEqual(active, 'power-saver')
+      self.assertEqual(selected, 'performance')
+
+      # Clients only get to read the page
+      reply, fd_list = self.dbus.call_with_unix_fd_list_sync(PP, PP_PATH, PP_INTERFACE, 'GetStatePage',
+          None, GLib.VariantType('(h)'), Gio.DBusCallFlags.NO_AUTO_START, -1, None, None)
+      fd = fd_list.get(reply.unpack()[0])
+      with self.assertRaises(OSError):
+        mmap.mmap(fd, 0, mmap.MAP_SHARED, mmap.PROT_READ | mmap.PROT_WRITE)
+      os.close(fd)
+
+      page.close()
+      self.stop_daemon()
+
+    def test_vanishing_holder_many_holds(self):
+      '''All the holds of a vanishing client are released, and only those'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      self.call_dbus_method('HoldProfile', GLib.Variant("(sss)", ('performance', '', 'stays')))
+
+      client = Gio.DBusConnection.new_for_address_sync(self.test_bus.get_bus_address(),
+          Gio.DBusConnectionFlags.AUTHENTICATION_CLIENT | Gio.DBusConnectionFlags.MESSAGE_BUS_CONNECTION,
+          None, None)
+      proxy = Gio.DBusProxy.new_sync(
+          client, Gio.DBusProxyFlags.DO_NOT_AUTO_START, None, PP,
+          PP_PATH, PP_INTERFACE, None)
+      for i in range(5):
+        proxy.call_sync('HoldProfile', GLib.Variant("(sss)", ('power-saver', '', 'vanishing')),
+                        Gio.DBusCallFlags.NO_AUTO_START, -1, None)
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 6)
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'power-saver')
+
+      client.close_sync(None)
+      self.assertEventually(lambda: len(self.get_dbus_property('ActiveProfileHolds')) == 1)
+      holds = self.get_dbus_property('ActiveProfileHolds')
+      self.assertEqual(holds[0]['ApplicationId'], 'stays')
+      self.assertEventually(lambda: self.get_dbus_property('ActiveProfile') == 'performance')
+
+      self.stop_daemon()
+
+    def test_vanishing_holder_shared_watch(self):
+      '''Holds of a client share its watch until the last one is released'''
+
+      self.create_platform_profile()
+      self.start_daemon()
+
+      client = Gio.DBusConnection.new_for_address_sync(self.test_bus.get_bus_address(),
+          Gio.DBusConnectionFlags.AUTHENTICATION_CLIENT | Gio.DBusConnectionFlags.MESSAGE_BUS_CONNECTION,
+          None, None)
+      proxy = Gio.DBusProxy.new_sync(
+          client, Gio.DBusProxyFlags.DO_NOT_AUTO_START, None, PP,
+          PP_PATH, PP_INTERFACE, None)
+      cookies = []
+      for i in range(5):
+        cookie = proxy.call_sync('HoldProfile', GLib.Variant("(sss)", ('power-saver', '', 'vanishing')),
+                                 Gio.DBusCallFlags.NO_AUTO_START, -1, None)
+        cookies.append(cookie.unpack()[0])
+      self.assertEqual(len(set(cookies)), 5)
+      self.assertNotIn(0, cookies)
+
+      # Releasing some of the holds keeps watching for the others
+      for cookie in cookies[:4]:
+        proxy.call_sync('ReleaseProfile', GLib.Variant("(u)", (cookie,)),
+                        Gio.DBusCallFlags.NO_AUTO_START, -1, None)
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 1)
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'power-saver')
+
+      client.close_sync(None)
+      self.assertEventually(lambda: len(self.get_dbus_property('ActiveProfileHolds')) == 0)
+      self.assertEventually(lambda: self.get_dbus_property('ActiveProfile') == 'balanced')
+
+      self.stop_daemon()
+
     def test_hold_priority(self):
       '''power-saver should take priority over performance'''
       self.create_platform_profile()
@@ -1137,6 +1745,42 @@ class Tests(dbusmock.DBusTestCase):
       self.assertEventually(lambda: self.get_dbus_property('ActiveProfile') == 'power-saver')
       self.stop_daemon()
 
+    def test_deferred_load_keeps_holds(self):
+      '''profile holds survive the kernel driver being loaded after start'''
+
+      # Create CPU with preference, so that performance can be held
+      dir1 = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/cpufreq/policy0/")
+      os.makedirs(dir1)
+      with open(os.path.join(dir1, 'scaling_governor'), 'w') as gov:
+        gov.write('powersave\n')
+      with open(os.path.join(dir1, "energy_performance_preference"),'w') as prefs:
+        prefs.write("performance\n")
+      pstate_dir = os.path.join(self.testbed.get_root_dir(), "sys/devices/system/cpu/intel_pstate")
+      os.makedirs(pstate_dir)
+      with open(os.path.join(pstate_dir, "status"),'w') as status:
+        status.write("active\n")
+
+      self.create_empty_platform_profile()
+      self.start_daemon()
+      self.assertEqual(self.get_dbus_property('Profiles')[0]['Driver'], 'intel_pstate')
+
+      self.call_dbus_method('HoldProfile', GLib.Variant("(sss)", ('performance', 'benchmark', 'testsuite')))
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'performance')
+
+      acpi_dir = os.path.join(self.testbed.get_root_dir(), "sys/firmware/acpi/")
+      with open(os.path.join(acpi_dir, "platform_profile_choices"),'w') as choices:
+        choices.write("low-power\nbalanced\nperformance\n")
+      with open(os.path.join(acpi_dir, "platform_profile"),'w') as profile:
+        profile.write("balanced\n")
+
+      self.assertEventually(lambda: self.get_dbus_property('Profiles')[0]['Driver'] == 'platform_profile')
+      self.assertEventually(lambda: self.read_sysfs_file("sys/firmware/acpi/platform_profile") == b'performance')
+      self.assertEqual(self.get_dbus_property('ActiveProfile'), 'performance')
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 1)
+      self.assertFalse(self.have_text_in_log('Releasing active profile holds'))
+
+      self.stop_daemon()
+
     def test_not_allowed_profile(self):
       '''Check that we get errors when trying to change a profile and not allowed'''
 
@@ -1169,6 +1813,26 @@ class Tests(dbusmock.DBusTestCase):
 
       self.stop_daemon()
 
+    def test_authorization_cached(self):
+      '''Check that authorizations are cached per sender and action'''
+
+      self.obj_polkit.SetAllowed(['net.hadess.PowerProfiles.hold-profile'])
+      self.create_platform_profile()
+      self.start_daemon()
+
+      self.call_dbus_method('HoldProfile', GLib.Variant("(sss)", ('performance', '', '')))
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 1)
+
+      # Our earlier authorization is reused, switching was never authorized
+      self.obj_polkit.SetAllowed(dbus.Array([], signature='s'))
+      self.call_dbus_method('HoldProfile', GLib.Variant("(sss)", ('power-saver', '', '')))
+      self.assertEqual(len(self.get_dbus_property('ActiveProfileHolds')), 2)
+      with self.assertRaises(gi.repository.GLib.GError) as cm:
+        self.set_dbus_property('ActiveProfile', GLib.Variant.new_string('balanced'))
+      self.assertIn('AccessDenied', str(cm.exception))
+
+      self.stop_daemon()
+
     def test_intel_pstate_noturbo(self):
       '''Intel P-State driver (balance)'''
 